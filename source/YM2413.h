@@ -9,12 +9,21 @@
 
 #include <c8051f120.h>
 #include <stdint.h>
+#include "stats.h"
+#include "bench.h"
 
 //------------------------------------------------------------------------------------
 // Global Constants
 //------------------------------------------------------------------------------------
 #define MAX_VOICES 	9
 
+#define NUM_REGISTERS	0x39	// Registers 0x00 ~ 0x38
+
+#define YM_CLOCK		3579545	// YM2413 master clock in Hz
+// IC must be held low for at least 80 master clocks, about 22 us. Rounded up to
+// delay_us() steps, plus one because its first step can be cut short.
+#define IC_PULSE_US		((((80UL * 1000000 + YM_CLOCK - 1) / YM_CLOCK + 4) / 5 + 1) * 5)
+
 #define NOTE_OFF 	0
 #define NOTE_ON		1
 
@@ -30,10 +39,12 @@ typedef enum {
 	vibraphone, synthesizer_bass, wood_bass, electric_guitar
 } inst_t;
 
+// Plain bytes rather than bitfields, so every access is a single MOV
 typedef struct {
 	uint8_t note;
-	uint8_t instrument : 4;
-	uint8_t state : 4;
+	uint8_t instrument;
+	uint8_t state;
+	uint8_t vol;			// Volume last set, before any tremolo
 } voice_t;
 
 typedef struct {
@@ -51,20 +62,29 @@ __sbit __at (0xA2) CS;		// Chip Select (active low)
 __sbit __at (0xA3) IC;		// Chip reset (bringing low will reset the chip)
 
 // Lookup table starts with C at 0, B at 11...
-__xdata static const uint16_t fnum_lookup[12] = {	// Relies on using the stock oscillator
+__code static const uint16_t fnum_lookup[12] = {	// Relies on using the stock oscillator
 	172, 181, 192, 204, 216, 229,					// FNum could be calculated on the fly but it would be expensive
 	242, 257, 272, 288, 305, 323
 };
 
 // synth keeps track of all the voices available
-static synth_t synth;
+// Always indexed by voice, so idata costs nothing over data here
+__idata static synth_t synth;
 
 // voiceItr keeps track of round-robin partitioning of voices
-static uint8_t voiceItr = 0;
+__data static uint8_t voiceItr = 0;
+
+// Copy of what was last written to each register, so no-op writes can be skipped
+__xdata static uint8_t regShadow[NUM_REGISTERS];
+// Clear until the first reset, while what the chip holds is unknown
+__data static uint8_t shadowValid = 0;
+// Set by synthHold() while IC is being held low
+__xdata static uint8_t resetHeld = 0;
 
 //------------------------------------------------------------------------------------
 // Function Prototypes
 //------------------------------------------------------------------------------------
+void synthHold(void);
 void synthInit(void);
 void resetSynth(void);
 void testSynth(void);
@@ -85,20 +105,36 @@ static inline uint8_t get_octave(uint8_t note);
 extern void delay_us(uint16_t waitTime);
 
 //------------------------------------------------------------------------------------
-// synthInit
+// synthHold
 //------------------------------------------------------------------------------------
-// Initialize ports, reset synth
-void synthInit(void)
+// Initialize ports and put the chip into reset. Called early at power on so the
+// reset pulse overlaps the clock start up, synthInit() lets it go.
+void synthHold(void)
 {
 	char SFRPAGE_SAVE = SFRPAGE;
 	SFRPAGE = CONFIG_PAGE;
 	P3MDOUT  = 0XFF;		// Data line
 	P2MDOUT |= 0X0F;		// Control lines
 
-	resetSynth();
+	// Set chip in high impedance mode, held in reset
+	CS = 1;
+	WE = 1;
+	ADDR = 1;
+	IC = 0;
+	resetHeld = 1;
 	SFRPAGE = SFRPAGE_SAVE;
 }
 
+//------------------------------------------------------------------------------------
+// synthInit
+//------------------------------------------------------------------------------------
+// Initialize ports, reset synth
+void synthInit(void)
+{
+	if(!resetHeld) synthHold();
+	resetSynth();
+}
+
 //------------------------------------------------------------------------------------
 // PUBLIC FUNCTION IMPLEMENTATIONS
 //------------------------------------------------------------------------------------
@@ -106,31 +142,38 @@ void synthInit(void)
 //------------------------------------------------------------------------------------
 // resetSynth
 //------------------------------------------------------------------------------------
-// Reset physical chip, send all data from the struct
+// Reset physical chip and the struct to match it
+// The chip comes out of reset with every register at 0: rhythm off and every voice
+// keyed off on the custom instrument. That is already a silent state, so nothing
+// needs to be written and the shadow just starts out at 0 too.
 void resetSynth(void)
 {
-	char i;
+	uint8_t i;
 
-	// Reset the chip using the IC line
-	IC = 0;
-
-	// Set chip in high impedance mode
-	CS = 1;
-	WE = 1;
-	ADDR = 1;
-	delay_us(50000);
+	// Reset the chip using the IC line, unless synthHold() already did
+	if(!resetHeld)
+	{
+		// Set chip in high impedance mode
+		CS = 1;
+		WE = 1;
+		ADDR = 1;
+		IC = 0;
+		delay_us(IC_PULSE_US);
+	}
 	IC = 1;
-	
-	// Turn off the rhythm stuff
-	writeRegister(0x0E, 0x00);
-	
-	// Turn off all voices and set them to GITAR
+	resetHeld = 0;
+
+	for(i = 0; i < NUM_REGISTERS; ++i)
+		regShadow[i] = 0x00;
 	for(i = 0; i < MAX_VOICES; ++i)
 	{
-		setNote(i, 0, NOTE_OFF);
-		setInstrument(i, guitar, 0xF);
+		synth.voices[i].note = 0;
+		synth.voices[i].instrument = custom;
+		synth.voices[i].state = NOTE_OFF;
+		synth.voices[i].vol = 0;
 	}
 	
+	shadowValid = 1;
 	voiceItr = 0;
 }
 
@@ -154,12 +197,13 @@ void testSynth()
 //------------------------------------------------------------------------------------
 // noteON
 //------------------------------------------------------------------------------------
-// Turn on a new note
+// Turn on a new note, returns the voice used or -1 if none was free
 // Uses round robin w/ a status iterator to reduce voice stealing for long releases
 int8_t noteOn(uint8_t note, uint8_t instr, uint8_t vol)
 {
 	char i = 0;
 	char voice;
+	BENCH_BEGIN(BENCH_NOTE_ON);
 	while(i < MAX_VOICES)
 	{
 		voice = (i + voiceItr) % MAX_VOICES;
@@ -169,13 +213,16 @@ int8_t noteOn(uint8_t note, uint8_t instr, uint8_t vol)
 			setInstrument(voice, instr, vol >> 3);
 			setNote(voice, note, NOTE_ON);
 			voiceItr = (voiceItr + 1) % MAX_VOICES;
-			return 0;
+			BENCH_END(BENCH_NOTE_ON);
+			return voice;
 		}
 		++i;
 	}
 	// Move the round robin tracker
 	voiceItr = (voiceItr + 1) % MAX_VOICES;
 	// If we couldn't allocate a new voice, just quit :(
+	STAT_INC(notesDropped);
+	BENCH_END(BENCH_NOTE_ON);
 	return -1;
 }
 
@@ -186,6 +233,7 @@ int8_t noteOn(uint8_t note, uint8_t instr, uint8_t vol)
 int8_t noteOff(uint8_t note, uint8_t instr)
 {
 	char voice = 0;
+	BENCH_BEGIN(BENCH_NOTE_OFF);
 	while(voice < MAX_VOICES)
 	{
 		// If this note is ON, has same NOTE, has same INSTR, turn it off
@@ -194,11 +242,14 @@ int8_t noteOff(uint8_t note, uint8_t instr)
 			synth.voices[voice].instrument 	== instr)
 		{
 			setNote(voice, note, NOTE_OFF);
+			BENCH_END(BENCH_NOTE_OFF);
 			return 0;
 		}
 		++voice;
 	}
 	// This voice was not currently on
+	STAT_INC(orphanNoteOffs);
+	BENCH_END(BENCH_NOTE_OFF);
 	return -1;
 }
 
@@ -206,12 +257,13 @@ int8_t noteOff(uint8_t note, uint8_t instr)
 // killAll
 //------------------------------------------------------------------------------------
 // Turn off all notes
+// Only the key bit is cleared, so voices that are already off cost no writes
 void killAll(void)
 {
 	char voice;
 	for(voice = 0; voice < MAX_VOICES; ++voice)
 	{
-		setNote(voice, synth.voices[voice].note, NOTE_OFF);
+		writeRegister(0x20 + voice, regShadow[0x20 + voice] & ~0x10);
 		synth.voices[voice].state = NOTE_OFF;
 	}
 }
@@ -224,8 +276,26 @@ void killAll(void)
 // writeRegister
 //------------------------------------------------------------------------------------
 // Write 8 bits of "data" to Ym2413 register "addr"
+// Writes that would not change the register are skipped
 static void writeRegister(uint8_t addr, uint8_t data)
 {
+	BENCH_BEGIN(BENCH_WRITE_REGISTER);
+	if(addr < NUM_REGISTERS)
+	{
+		if(shadowValid && regShadow[addr] == data)
+		{
+			STAT_COUNT(regWritesElided);
+			BENCH_END(BENCH_WRITE_REGISTER);
+			return;
+		}
+		regShadow[addr] = data;
+	}
+	STAT_COUNT(regWrites);
+#ifdef YM2413_TRACE
+	// Lets host-side tools see what the driver puts on the bus
+	YM2413_TRACE(addr, data);
+#endif
+
 	WE = 0;
 	ADDR = 0;
 	delay_us(2);
@@ -254,6 +324,9 @@ static void writeRegister(uint8_t addr, uint8_t data)
 	// Leave the chip in high impedance mode
 	WE = 1;
 	CS = 1;
+	// Give the chip time to take the data before the next write
+	delay_us(20);
+	BENCH_END(BENCH_WRITE_REGISTER);
 }
 
 //------------------------------------------------------------------------------------
@@ -274,7 +347,6 @@ static void setNote(uint8_t voice, uint8_t note, uint8_t state)
 	// 	 F Num LSB [0~7]
 	data = (uint8_t)(fnum & 0xFF);
 	writeRegister(0x10 + voice, data);
-	delay_us(20);
 	// Set address 0x20 + [voice] to be:
 	//   F Num MSb [0]
 	//   Octave Setting [1~3]
@@ -284,7 +356,6 @@ static void setNote(uint8_t voice, uint8_t note, uint8_t state)
 	data |= (fnum >> 8) & 0x01;
 	data |= (oct & 0x07) << 1;
 	writeRegister(0x20 + voice, data);
-	delay_us(20);
 }
 
 //------------------------------------------------------------------------------------
@@ -297,8 +368,8 @@ static void setInstrument(uint8_t voice, uint8_t instrument, uint8_t vol)
 	uint8_t data = (instrument << 4) & 0xF0;
 	data |= (vol & 0xF);
 	synth.voices[voice].instrument = instrument & 0xF;
+	synth.voices[voice].vol = vol & 0xF;
 	writeRegister(0x30 + voice, data);
-	delay_us(20);
 }
 
 //------------------------------------------------------------------------------------
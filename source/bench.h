@@ -0,0 +1,168 @@
+/* bench.h
+ *
+ * Ken Schmitt and Frank Sinapi
+ * MPS at RPI, Fall 2017
+ * ------------------------------------------------------------------------------------
+ * Cycle counters for the hot paths, only compiled in when BENCH is defined.
+ *
+ * Timer 0 free runs from SYSCLK and BENCH_BEGIN/BENCH_END add the ticks spent
+ * between them to a per-function total. On the board a tick is a SYSCLK cycle;
+ * an 8052 simulator has no CKCON, so there it is a 12 clock machine cycle. Calls nest, so a total includes whatever
+ * the function called. The results are read back with the SysEx commands handled
+ * in the main driver, see tools/bench.
+ *
+ * BENCH builds also drop the bus delays from delay_us() so only CPU time is
+ * counted, skip the oscillator and PLL start up (an 8052 simulator would poll
+ * Timer 0 registers forever in its place), and can pin the mode switch with
+ * BENCH_MODE (1 = MIDI, 0 = keyboard) since nothing drives the pin in a simulator.	*/
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdint.h>
+
+//------------------------------------------------------------------------------------
+// Global Constants
+//------------------------------------------------------------------------------------
+#define BENCH_WAITING			0
+#define BENCH_ONE_BYTE			1
+#define BENCH_TWO_BYTES			2
+#define BENCH_NOTE_ON			3
+#define BENCH_NOTE_OFF			4
+#define BENCH_UPDATE_KEYBOARD	5
+#define BENCH_WRITE_REGISTER	6
+#define NUM_BENCH				7
+
+#define BENCH_KBD_SCANS			256		// Keyboard scans to time in keyboard mode
+
+#ifdef BENCH
+
+#include <c8051f120.h>
+#include <stdio.h>
+
+//------------------------------------------------------------------------------------
+// Global Variables
+//------------------------------------------------------------------------------------
+__xdata static uint32_t benchCycles[NUM_BENCH];
+__xdata static uint16_t benchCalls[NUM_BENCH];
+__xdata static uint32_t benchStart[NUM_BENCH];
+static volatile uint16_t benchOverflows;
+static uint16_t benchOverhead;
+
+#define BENCH_BEGIN(id)	do { benchStart[id] = benchNow(); } while(0)
+#define BENCH_END(id)	do { benchCycles[id] += benchNow() - benchStart[id] - benchOverhead; \
+							 ++benchCalls[id]; } while(0)
+
+//------------------------------------------------------------------------------------
+// benchNow
+//------------------------------------------------------------------------------------
+// Read the 32-bit SYSCLK cycle count, from any SFR page
+uint32_t benchNow(void)
+{
+	char SFRPAGE_SAVE = SFRPAGE;
+	uint8_t high, low;
+	uint16_t overflows;
+
+	SFRPAGE = TIMER01_PAGE;
+	do
+	{
+		overflows = benchOverflows;
+		high = TH0;
+		low = TL0;
+	} while(high != TH0 || overflows != benchOverflows);
+	SFRPAGE = SFRPAGE_SAVE;
+
+	return ((uint32_t)overflows << 16) | ((uint16_t)high << 8) | low;
+}
+
+//------------------------------------------------------------------------------------
+// benchReset
+//------------------------------------------------------------------------------------
+// Clear the totals
+void benchReset(void)
+{
+	uint8_t i;
+	for(i = 0; i < NUM_BENCH; ++i)
+	{
+		benchCycles[i] = 0;
+		benchCalls[i] = 0;
+	}
+}
+
+//------------------------------------------------------------------------------------
+// benchInit
+//------------------------------------------------------------------------------------
+// Start Timer 0 as a 16-bit SYSCLK counter and measure what a BEGIN/END pair costs
+void benchInit(void)
+{
+	char SFRPAGE_SAVE = SFRPAGE;
+	SFRPAGE = TIMER01_PAGE;
+
+	TMOD   &= ~0x0F;
+	TMOD   |=  0x01;            // Timer0, Mode 1: 16-bit counter/timer
+	CKCON  |=  0x08;            // Timer0 uses SYSCLK as time base
+	TL0     = 0;
+	TH0     = 0;
+	ET0     = 1;
+	TR0     = 1;
+
+	SFRPAGE = SFRPAGE_SAVE;
+
+	benchOverhead = 0;
+	BENCH_BEGIN(0);
+	BENCH_END(0);
+	benchOverhead = benchCycles[0];
+	benchReset();
+}
+
+//------------------------------------------------------------------------------------
+// benchSend
+//------------------------------------------------------------------------------------
+// Send the call count (three 7-bit bytes) and cycle total (five 7-bit bytes) of
+// every counter, LSB first, to go inside a SysEx message
+void benchSend(void)
+{
+	uint8_t i, j;
+	uint32_t value;
+	for(i = 0; i < NUM_BENCH; ++i)
+	{
+		value = benchCalls[i];
+		for(j = 0; j < 3; ++j)
+		{
+			putchar(value & 0x7F);
+			value >>= 7;
+		}
+		value = benchCycles[i];
+		for(j = 0; j < 5; ++j)
+		{
+			putchar(value & 0x7F);
+			value >>= 7;
+		}
+	}
+}
+
+//------------------------------------------------------------------------------------
+// benchDone
+//------------------------------------------------------------------------------------
+// Does nothing, simulator scripts put a breakpoint here to know the run is over
+void benchDone(void)
+{
+}
+
+//------------------------------------------------------------------------------------
+// T0_ISR
+//------------------------------------------------------------------------------------
+// Extend Timer 0 to 32 bits
+void T0_ISR (void) __interrupt 1
+{
+	++benchOverflows;
+}
+
+#else
+
+#define BENCH_BEGIN(id)
+#define BENCH_END(id)
+
+#endif /* BENCH */
+
+#endif /* BENCH_H */
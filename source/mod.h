@@ -0,0 +1,365 @@
+/* mod.h
+ *
+ * Ken Schmitt and Frank Sinapi
+ * MPS at RPI, Fall 2017
+ * ------------------------------------------------------------------------------------
+ * Software vibrato, tremolo and portamento. The YM2413's own vibrato and AM are a
+ * fixed depth and only reachable through the custom patch, and it has no glide,
+ * so the mod wheel and portamento are done here.
+ *
+ * Each MIDI channel has an LFO (a phase into a sine table in code memory) with a
+ * vibrato depth (CC1), tremolo depth (CC92) and rate (CC76), and a portamento
+ * switch (CC65) and time (CC5). modService() runs on the control tick set by
+ * Timer 3, works out the F-number and volume every keyed voice should have right
+ * now, and writes only the registers that changed. It stops after a given number of
+ * writes and carries on from the same voice next tick, so modulation can't hold
+ * up note events.
+ *
+ * Gliding voices keep their pitch in 1/256ths of a semitone and step it towards
+ * the note they were given every tick. The F-number is interpolated between the
+ * table entries of the two notes around the pitch, with B going up to twice the C
+ * F-number, so a glide moves across a block boundary without a jump and without
+ * keying the voice again.														*/
+
+#ifndef MOD_H
+#define MOD_H
+
+#include <stdint.h>
+#include "YM2413.h"
+
+//------------------------------------------------------------------------------------
+// Global Constants
+//------------------------------------------------------------------------------------
+#define MOD_TICK_MS			10		// Milliseconds per control tick (100 Hz)
+
+#define MOD_WRITES_IDLE		12		// Writes allowed per tick with no MIDI waiting
+#define MOD_WRITES_BUSY		3		// Writes allowed per tick while MIDI is waiting
+
+#define MOD_CHANNELS		16
+#define MOD_SINE_SHIFT		10		// Phase bits below the sine table index
+#define MOD_NO_NOTE			0xFF
+
+#define CC_PORTAMENTO_TIME	5
+#define CC_MOD_WHEEL		1
+#define CC_PORTAMENTO		65
+#define CC_VIBRATO_RATE		76
+#define CC_TREMOLO_DEPTH	92
+#define CC_RESET_ALL		121
+
+#define MOD_RATE_DEFAULT	64		// CC76 value of about 5.5 Hz
+
+//------------------------------------------------------------------------------------
+// Global Variables
+//------------------------------------------------------------------------------------
+// One cycle of a sine, -127 ~ 127
+__code static const int8_t modSine[64] = {
+	   0,   12,   25,   37,   49,   60,   71,   81,
+	  90,   98,  106,  112,  117,  122,  125,  126,
+	 127,  126,  125,  122,  117,  112,  106,   98,
+	  90,   81,   71,   60,   49,   37,   25,   12,
+	   0,  -12,  -25,  -37,  -49,  -60,  -71,  -81,
+	 -90,  -98, -106, -112, -117, -122, -125, -126,
+	-127, -126, -125, -122, -117, -112, -106,  -98,
+	 -90,  -81,  -71,  -60,  -49,  -37,  -25,  -12
+};
+
+// Glide step per tick in 1/256ths of a semitone for CC5 / 8, from 16 semitones
+// a tick down to an octave in about 4 seconds
+__code static const uint16_t modGlideSteps[16] = {
+	4096, 2702, 1783, 1176,  776,  512,  338,  223,
+	 147,   97,   64,   42,   28,   18,   12,    8
+};
+
+__xdata static uint8_t modVibDepth[MOD_CHANNELS];
+__xdata static uint8_t modTremDepth[MOD_CHANNELS];
+__xdata static uint16_t modRate[MOD_CHANNELS];		// Phase step per tick
+__xdata static uint16_t modPhase[MOD_CHANNELS];
+
+__xdata static uint8_t modPortamento[MOD_CHANNELS];
+__xdata static uint16_t modGlideStep[MOD_CHANNELS];
+__xdata static uint8_t modLastNote[MOD_CHANNELS];	// Where the next glide starts from
+__xdata static uint8_t modLegatoNote[MOD_CHANNELS];	// Note taken over by a legato glide
+
+__xdata static uint16_t modPitch[MAX_VOICES];		// Pitch of a gliding voice, note << 8
+__data static uint16_t modGliding;					// One bit per voice
+__data static uint8_t modRegs[3];					// Output of modVoiceRegs()
+
+__data static uint8_t modActive;		// Some channel has a depth set
+__data static uint8_t modRestore;		// Voices may still be off their unmodulated values
+__data static uint8_t modNext;			// Voice to start from next tick
+
+//------------------------------------------------------------------------------------
+// Function Prototypes
+//------------------------------------------------------------------------------------
+void modReset(void);
+void modControl(uint8_t channel, uint8_t control, uint8_t value);
+void modNoteOn(uint8_t note, uint8_t channel, uint8_t vol);
+void modNoteOff(uint8_t note, uint8_t channel);
+void modService(uint8_t maxWrites);
+
+static void modResetChannel(uint8_t channel);
+static uint8_t modVoiceRegs(uint8_t voice);
+static void modWriteVoice(uint8_t voice);
+static uint16_t modFnum(uint16_t pitch);
+
+//------------------------------------------------------------------------------------
+// modReset
+//------------------------------------------------------------------------------------
+// Turn modulation and glides off on every channel
+void modReset(void)
+{
+	uint8_t ch;
+	for(ch = 0; ch < MOD_CHANNELS; ++ch)
+		modResetChannel(ch);
+	modGliding = 0;
+	modActive = 0;
+	modRestore = 0;
+	modNext = 0;
+}
+
+//------------------------------------------------------------------------------------
+// modControl
+//------------------------------------------------------------------------------------
+// Handle a control change. Controllers that aren't ours are ignored.
+void modControl(uint8_t channel, uint8_t control, uint8_t value)
+{
+	uint8_t ch;
+	channel &= 0x0F;
+	switch(control)
+	{
+		case CC_MOD_WHEEL:
+			modVibDepth[channel] = value;
+			break;
+		case CC_TREMOLO_DEPTH:
+			modTremDepth[channel] = value;
+			break;
+		case CC_VIBRATO_RATE:
+			// About 0.6 Hz to 10 Hz
+			modRate[channel] = (uint16_t)(value + 8) * 50;
+			return;
+		case CC_PORTAMENTO:
+			modPortamento[channel] = value >= 64;
+			return;
+		case CC_PORTAMENTO_TIME:
+			modGlideStep[channel] = modGlideSteps[value >> 3];
+			return;
+		case CC_RESET_ALL:
+			modResetChannel(channel);
+			break;
+		default:
+			return;
+	}
+
+	// A depth changed, so every voice gets looked at until they settle
+	modRestore = 1;
+	modActive = 0;
+	for(ch = 0; ch < MOD_CHANNELS; ++ch)
+		if(modVibDepth[ch] || modTremDepth[ch]) modActive = 1;
+}
+
+//------------------------------------------------------------------------------------
+// modNoteOn
+//------------------------------------------------------------------------------------
+// Start a note, gliding to it from the channel's last note if portamento is on.
+// A note played while another on the same channel is still held takes that voice
+// over instead (legato), so a mono line glides without being keyed again. The
+// held note struck again is keyed normally, or its one note-off would be lost.
+void modNoteOn(uint8_t note, uint8_t channel, uint8_t vol)
+{
+	uint8_t v;
+	int8_t voice;
+	uint16_t bit;
+
+	if(modPortamento[channel])
+	{
+		for(v = 0; v < MAX_VOICES; ++v)
+		{
+			if(synth.voices[v].state != NOTE_ON || synth.voices[v].instrument != channel) continue;
+			if(synth.voices[v].note == note) continue;
+			bit = 1 << v;
+			if(!(modGliding & bit)) modPitch[v] = (uint16_t)synth.voices[v].note << 8;
+			modGliding |= bit;
+			modRestore = 1;
+			modLegatoNote[channel] = synth.voices[v].note;
+			modLastNote[channel] = note;
+			synth.voices[v].note = note;
+			setInstrument(v, channel, vol >> 3);
+			return;
+		}
+	}
+
+	if(modPortamento[channel] && modLastNote[channel] != MOD_NO_NOTE && modLastNote[channel] != note)
+	{
+		// Key on where the glide starts, then aim the voice at the new note
+		voice = noteOn(modLastNote[channel], channel, vol);
+		if(voice < 0) return;
+		bit = 1 << voice;
+		modPitch[voice] = (uint16_t)modLastNote[channel] << 8;
+		synth.voices[voice].note = note;
+		modGliding |= bit;
+		modRestore = 1;
+	}
+	else
+	{
+		voice = noteOn(note, channel, vol);
+		if(voice < 0) return;
+		modGliding &= ~(1 << voice);
+	}
+	modLastNote[channel] = note;
+}
+
+//------------------------------------------------------------------------------------
+// modNoteOff
+//------------------------------------------------------------------------------------
+// Stop a note, unless its voice was already handed on to a legato note
+void modNoteOff(uint8_t note, uint8_t channel)
+{
+	if(modLegatoNote[channel] == note)
+	{
+		modLegatoNote[channel] = MOD_NO_NOTE;
+		return;
+	}
+	noteOff(note, channel);
+}
+
+//------------------------------------------------------------------------------------
+// modService
+//------------------------------------------------------------------------------------
+// Move every LFO and glide on by one tick and bring the voices up to date, making
+// at most "maxWrites" register writes
+void modService(uint8_t maxWrites)
+{
+	uint8_t ch, i, v, writes = 0, need;
+	uint16_t target, step, bit, moving = 0;
+
+	if(!modActive && !modRestore) return;
+
+	for(ch = 0; ch < MOD_CHANNELS; ++ch)
+		if(modVibDepth[ch] || modTremDepth[ch]) modPhase[ch] += modRate[ch];
+
+	// Glides move with time whether or not their writes fit in this tick. A voice
+	// that has been let go was put on its own note by setNote(), so its glide ends.
+	for(v = 0, bit = 1; v < MAX_VOICES; ++v, bit <<= 1)
+	{
+		if(!(modGliding & bit)) continue;
+		if(synth.voices[v].state != NOTE_ON)
+		{
+			modGliding &= ~bit;
+			continue;
+		}
+		target = (uint16_t)synth.voices[v].note << 8;
+		step = modGlideStep[synth.voices[v].instrument];
+		if(modPitch[v] < target)
+			modPitch[v] = (target - modPitch[v] > step) ? modPitch[v] + step : target;
+		else
+			modPitch[v] = (modPitch[v] - target > step) ? modPitch[v] - step : target;
+		if(modPitch[v] == target) modGliding &= ~bit;
+		else moving |= bit;
+	}
+
+	for(i = 0; i < MAX_VOICES; ++i)
+	{
+		v = modNext;
+		// Only keyed voices are modulated, a released one fades on what it has
+		need = (synth.voices[v].state == NOTE_ON) ? modVoiceRegs(v) : 0;
+		if(writes + need > maxWrites) return;
+		if(need) modWriteVoice(v);
+		writes += need;
+
+		modNext = (modNext + 1) % MAX_VOICES;
+	}
+
+	// Every voice is where it should be, nothing left to put back
+	if(!modActive && !moving) modRestore = 0;
+}
+
+//------------------------------------------------------------------------------------
+// STATIC FUNCTION IMPLEMENTATIONS
+//------------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------------
+// modResetChannel
+//------------------------------------------------------------------------------------
+// Put a channel's controllers back to their defaults
+static void modResetChannel(uint8_t channel)
+{
+	modVibDepth[channel] = 0;
+	modTremDepth[channel] = 0;
+	modRate[channel] = (uint16_t)(MOD_RATE_DEFAULT + 8) * 50;
+	modPhase[channel] = 0;
+	modPortamento[channel] = 0;
+	modGlideStep[channel] = modGlideSteps[0];
+	modLastNote[channel] = MOD_NO_NOTE;
+	modLegatoNote[channel] = MOD_NO_NOTE;
+}
+
+//------------------------------------------------------------------------------------
+// modVoiceRegs
+//------------------------------------------------------------------------------------
+// Work out what registers 0x10, 0x20 and 0x30 of a voice should hold right now,
+// into modRegs. Returns how many of them differ from what the chip has.
+static uint8_t modVoiceRegs(uint8_t voice)
+{
+	uint8_t ch = synth.voices[voice].instrument;
+	uint8_t note = synth.voices[voice].note;
+	uint8_t v, lo, hi, vol;
+	uint16_t fnum;
+	int8_t s = modSine[modPhase[ch] >> MOD_SINE_SHIFT];
+
+	if(modGliding & (1 << voice))
+	{
+		fnum = modFnum(modPitch[voice]);
+		note = modPitch[voice] >> 8;
+	}
+	else
+	{
+		fnum = get_fnum(note);
+	}
+
+	// Vibrato: up to about +/- 3% (half a semitone), within the same block
+	if(modVibDepth[ch])
+		fnum += ((int16_t)((fnum * modVibDepth[ch]) >> 8) * s) >> 11;
+
+	lo = fnum & 0xFF;
+	hi = (regShadow[0x20 + voice] & 0x30) | (get_octave(note) << 1) | ((fnum >> 8) & 0x01);
+
+	// Tremolo: up to 3 steps (9 dB) more attenuation
+	v = synth.voices[voice].vol;
+	if(modTremDepth[ch])
+	{
+		v += ((uint16_t)(s + 127) * modTremDepth[ch]) >> 13;
+		if(v > 0x0F) v = 0x0F;
+	}
+	vol = v | (regShadow[0x30 + voice] & 0xF0);
+
+	modRegs[0] = lo;
+	modRegs[1] = hi;
+	modRegs[2] = vol;
+	return (regShadow[0x10 + voice] != lo) + (regShadow[0x20 + voice] != hi) + (regShadow[0x30 + voice] != vol);
+}
+
+//------------------------------------------------------------------------------------
+// modWriteVoice
+//------------------------------------------------------------------------------------
+// Bring a voice's registers up to date, writing only the ones that changed
+static void modWriteVoice(uint8_t voice)
+{
+	modVoiceRegs(voice);
+	writeRegister(0x10 + voice, modRegs[0]);
+	writeRegister(0x20 + voice, modRegs[1]);
+	writeRegister(0x30 + voice, modRegs[2]);
+}
+
+//------------------------------------------------------------------------------------
+// modFnum
+//------------------------------------------------------------------------------------
+// F-number of a pitch between two notes, in the block of the lower note
+static uint16_t modFnum(uint16_t pitch)
+{
+	uint8_t n = (pitch >> 8) % 12;
+	uint16_t from = fnum_lookup[n];
+	uint16_t to = (n == 11) ? fnum_lookup[0] << 1 : fnum_lookup[n + 1];
+	return from + (((to - from) * (pitch & 0xFF)) >> 8);
+}
+
+#endif /* MOD_H */
@@ -0,0 +1,209 @@
+/* sched.h
+ *
+ * Ken Schmitt and Frank Sinapi
+ * MPS at RPI, Fall 2017
+ * ------------------------------------------------------------------------------------
+ * Note scheduler for timed MIDI. The host tags notes and control changes with the
+ * millisecond tick it wants them played at, and they are held here until then so
+ * USB-serial batching does not turn into audible jitter.
+ *
+ * Host ticks are mapped onto the board's clock by the first tag seen after
+ * schedStart(), plus a lookahead that has to cover the worst delay on the link.
+ * Notes that arrive after their time are played straight away.
+ *
+ * Pending notes live in a binary heap in XRAM, ordered by due time and then by
+ * arrival so notes tagged with the same tick keep their order.					*/
+
+#ifndef SCHED_H
+#define SCHED_H
+
+#include <stdint.h>
+#include "YM2413.h"
+#include "mod.h"
+#include "stats.h"
+
+//------------------------------------------------------------------------------------
+// Global Constants
+//------------------------------------------------------------------------------------
+#define SCHED_SIZE		64
+#define SCHED_TAG_MASK	0x3FFF		// Host ticks are sent as two 7-bit bytes
+
+// What an entry does when its time comes
+#define SCHED_NOTE_OFF	0
+#define SCHED_NOTE_ON	1
+#define SCHED_CONTROL	2			// "note" is the controller, "vol" its value
+
+//------------------------------------------------------------------------------------
+// Typedefs
+//------------------------------------------------------------------------------------
+typedef struct {
+	uint16_t due;
+	uint8_t seq;
+	uint8_t kind;
+	uint8_t note;
+	uint8_t instrument;
+	uint8_t vol;
+} sched_event_t;
+
+//------------------------------------------------------------------------------------
+// Global Variables
+//------------------------------------------------------------------------------------
+__xdata static sched_event_t schedHeap[SCHED_SIZE];
+__data static uint8_t schedCount;
+__data static uint8_t schedSeq;
+
+__data static uint16_t schedLookahead;
+__data static uint16_t schedOffset;		// Board tick minus host tick
+__data static uint16_t schedHostTick;	// Last host tick, widened to 16 bits
+__data static uint8_t schedSynced;
+
+//------------------------------------------------------------------------------------
+// Static Function Prototypes
+//------------------------------------------------------------------------------------
+static uint8_t schedBefore(uint8_t a, uint8_t b);
+static void schedSwap(uint8_t a, uint8_t b);
+static void schedPop(void);
+
+//------------------------------------------------------------------------------------
+// schedStart
+//------------------------------------------------------------------------------------
+// Empty the queue and wait for a tag to line the host's clock up with ours
+void schedStart(uint16_t lookahead)
+{
+	schedCount = 0;
+	schedLookahead = lookahead;
+	schedSynced = 0;
+}
+
+//------------------------------------------------------------------------------------
+// schedTag
+//------------------------------------------------------------------------------------
+// Take a 14-bit host tick and return the board tick notes tagged with it are due
+uint16_t schedTag(uint16_t tag, uint16_t now)
+{
+	if(!schedSynced)
+	{
+		schedHostTick = tag;
+		schedOffset = now - tag;
+		schedSynced = 1;
+	}
+	else
+	{
+		// Host ticks only move forward, so take the next one with these low bits
+		schedHostTick += (tag - schedHostTick) & SCHED_TAG_MASK;
+	}
+	return schedHostTick + schedOffset + schedLookahead;
+}
+
+//------------------------------------------------------------------------------------
+// schedPush
+//------------------------------------------------------------------------------------
+// Queue a note on, note off or control change to be played at tick "due"
+void schedPush(uint16_t due, uint16_t now, uint8_t kind, uint8_t note, uint8_t instrument, uint8_t vol)
+{
+	uint8_t i, parent;
+
+	if((int16_t)(due - now) < 0) STAT_INC(schedLate);
+
+	// No room, so the note due soonest goes out early
+	if(schedCount == SCHED_SIZE)
+	{
+		STAT_INC(schedOverflows);
+		schedPop();
+	}
+
+	i = schedCount++;
+	schedHeap[i].due = due;
+	schedHeap[i].seq = schedSeq++;
+	schedHeap[i].kind = kind;
+	schedHeap[i].note = note;
+	schedHeap[i].instrument = instrument;
+	schedHeap[i].vol = vol;
+	if(schedCount > stats.schedMaxDepth) stats.schedMaxDepth = schedCount;
+
+	// Sift up
+	while(i)
+	{
+		parent = (i - 1) >> 1;
+		if(!schedBefore(i, parent)) break;
+		schedSwap(i, parent);
+		i = parent;
+	}
+}
+
+//------------------------------------------------------------------------------------
+// schedService
+//------------------------------------------------------------------------------------
+// Play every note whose time has come
+void schedService(uint16_t now)
+{
+	while(schedCount && (int16_t)(now - schedHeap[0].due) >= 0)
+		schedPop();
+}
+
+//------------------------------------------------------------------------------------
+// schedFlush
+//------------------------------------------------------------------------------------
+// Play everything still queued, in order
+void schedFlush(void)
+{
+	while(schedCount)
+		schedPop();
+}
+
+//------------------------------------------------------------------------------------
+// STATIC FUNCTION IMPLEMENTATIONS
+//------------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------------
+// schedBefore
+//------------------------------------------------------------------------------------
+// Does heap entry "a" have to be played before entry "b"
+static uint8_t schedBefore(uint8_t a, uint8_t b)
+{
+	int16_t diff = schedHeap[a].due - schedHeap[b].due;
+	if(diff != 0) return diff < 0;
+	return (int8_t)(schedHeap[a].seq - schedHeap[b].seq) < 0;
+}
+
+//------------------------------------------------------------------------------------
+// schedSwap
+//------------------------------------------------------------------------------------
+// Swap two heap entries
+static void schedSwap(uint8_t a, uint8_t b)
+{
+	__xdata sched_event_t tmp;
+	tmp = schedHeap[a];
+	schedHeap[a] = schedHeap[b];
+	schedHeap[b] = tmp;
+}
+
+//------------------------------------------------------------------------------------
+// schedPop
+//------------------------------------------------------------------------------------
+// Play the earliest entry and take it off the heap
+static void schedPop(void)
+{
+	uint8_t i = 0, child;
+
+	if(schedHeap[0].kind == SCHED_NOTE_ON)
+		modNoteOn(schedHeap[0].note, schedHeap[0].instrument, schedHeap[0].vol);
+	else if(schedHeap[0].kind == SCHED_NOTE_OFF)
+		modNoteOff(schedHeap[0].note, schedHeap[0].instrument);
+	else
+		modControl(schedHeap[0].instrument, schedHeap[0].note, schedHeap[0].vol);
+
+	// Move the last entry to the top and sift it down
+	schedHeap[0] = schedHeap[--schedCount];
+	while(1)
+	{
+		child = (i << 1) + 1;
+		if(child >= schedCount) break;
+		if(child + 1 < schedCount && schedBefore(child + 1, child)) ++child;
+		if(!schedBefore(child, i)) break;
+		schedSwap(i, child);
+		i = child;
+	}
+}
+
+#endif /* SCHED_H */
@@ -0,0 +1,83 @@
+/* stats.h
+ *
+ * Ken Schmitt and Frank Sinapi
+ * MPS at RPI, Fall 2017
+ * ------------------------------------------------------------------------------------
+ * Runtime health counters. Lets us tell from the field whether a glitch was a
+ * capacity problem (no voice free, orphaned note-offs) or a throughput problem
+ * (UART overruns, RX buffer filling up, too many register writes).
+ *
+ * Counters saturate at 0xFFFF rather than wrapping, except the register write
+ * counts: busy playing runs those past 0xFFFF in minutes, so they wrap and
+ * the host takes the difference between two reads. They are read back and
+ * cleared over MIDI using the SysEx commands handled in the main driver.		*/
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+//------------------------------------------------------------------------------------
+// Typedefs
+//------------------------------------------------------------------------------------
+typedef struct {
+	uint16_t notesDropped;		// noteOn() found no free voice
+	uint16_t orphanNoteOffs;	// noteOff() for a note that was not sounding
+	uint16_t rxOverruns;		// UART0 hardware receive overruns (RXOV0)
+	uint16_t rxFramingErrors;	// UART0 framing errors (FE0)
+	uint16_t rxDropped;			// Bytes lost because the RX buffer was full
+	uint16_t rxMaxDepth;		// High water mark of the RX buffer
+	uint16_t regWrites;			// Register writes that went out on the bus, wraps
+	uint16_t regWritesElided;	// Register writes skipped as no-ops, wraps
+	uint16_t streamOverruns;	// Register stream bytes lost to a full buffer
+	uint16_t streamUnderruns;	// Register stream ran dry while playing
+	uint16_t schedLate;			// Timed notes that arrived after their time
+	uint16_t schedOverflows;	// Timed notes played early because the queue was full
+	uint16_t schedMaxDepth;		// High water mark of the timed note queue
+} stats_t;
+
+#define NUM_STATS (sizeof(stats_t) / sizeof(uint16_t))
+
+// Increment a counter, sticking at the max value instead of wrapping
+#define STAT_INC(field)	do { if(stats.field != 0xFFFF) ++stats.field; } while(0)
+
+// Increment a counter that wraps
+#define STAT_COUNT(field)	(++stats.field)
+
+//------------------------------------------------------------------------------------
+// Global Variables
+//------------------------------------------------------------------------------------
+__xdata static stats_t stats;
+
+//------------------------------------------------------------------------------------
+// statsReset
+//------------------------------------------------------------------------------------
+// Clear all counters. Caller must keep the UART interrupt from touching them.
+void statsReset(void)
+{
+	uint8_t i;
+	uint16_t *counter = (uint16_t *)&stats;
+	for(i = 0; i < NUM_STATS; ++i)
+		counter[i] = 0;
+}
+
+//------------------------------------------------------------------------------------
+// statsSend
+//------------------------------------------------------------------------------------
+// Send every counter as three 7-bit data bytes, LSB first, so the result can be
+// embedded in a SysEx message. "snapshot" should be a copy taken with the UART
+// interrupt disabled.
+void statsSend(stats_t *snapshot)
+{
+	uint8_t i;
+	uint16_t *counter = (uint16_t *)snapshot;
+	for(i = 0; i < NUM_STATS; ++i)
+	{
+		putchar(counter[i] & 0x7F);
+		putchar((counter[i] >> 7) & 0x7F);
+		putchar((counter[i] >> 14) & 0x03);
+	}
+}
+
+#endif /* STATS_H */
@@ -14,26 +14,76 @@
 #include <stdlib.h>
 #include "YM2413.h"
 #include "keyboard.h"
+#include "stats.h"
+#include "vgm.h"
+#include "sched.h"
+#include "mod.h"
+#include "bench.h"
 
 //------------------------------------------------------------------------------------
 // Global Constants
 //------------------------------------------------------------------------------------
+#define INTCLK      3062500             // Internal oscillator at reset, 24.5 MHz / 8
 #define EXTCLK      22118400            // External oscillator frequency in Hz
 #define SYSCLK      49766400            // Output of PLL derived from (EXTCLK * 9/4)
 #define BAUDRATE    115200              // UART baud rate in bps
 
 #define SYSCLK_D_12	(SYSCLK / 12)		// Sys clock divided by 12
 
+// Waits during clock start up, in Timer 0 counts of SYSCLK / 12
+#define XTAL_WAIT	(INTCLK / 12 / 1000 + 1)	// 1 ms before the crystal can be checked
+#define PLL_WAIT	(EXTCLK / 12 / 200000 + 1)	// 5 us for the PLL to power up
+
 #define TIMER_FREQ  (194400)                 // Frequency of timer 2 in Hz
 #define TICKS_T2    (SYSCLK / TIMER_FREQ)   // Number of ticks for 0.01 seconds
 #define T2_PRELOAD  ((0xFFFF) - TICKS_T2)   // Subtract ticks from T2 overflow level
 
+#define SAMPLE_RATE (44100)                 // Frequency of timer 3 in Hz while streaming, same as VGM samples
+#define TICKS_T3    ((SYSCLK + SAMPLE_RATE / 2) / SAMPLE_RATE)
+#define T3_PRELOAD  (0x10000 - TICKS_T3)
+#define TICKS_T3_MS ((SYSCLK + 500) / 1000) // Timer 3 runs at 1 kHz the rest of the time
+#define T3_MS_PRELOAD (0x10000 - TICKS_T3_MS)
+
 #define NOTE_ON_OPCODE 0x90
 #define NOTE_OFF_OPCODE 0x80
+#define CONTROL_CHANGE_OPCODE 0xB0
+#define TIMESTAMP		0xF9				// F9 ll hh: following notes are for host tick hhll
+
+#define SYSEX_START		0xF0
+#define SYSEX_END		0xF7
+#define SYSEX_ID		0x7D			// Non-commercial manufacturer ID
+#define SYSEX_MAX_LEN	8				// Longest SysEx body we care about
+
+#define SYSEX_STATS_REQUEST	0x01		// F0 7D 01 F7 -> reply F0 7D 01 <counters> F7
+#define SYSEX_STATS_RESET	0x02		// F0 7D 02 F7
+#define SYSEX_BOOT_REQUEST	0x03		// F0 7D 03 F7 -> reply F0 7D 03 <boot time in us> F7
+#define SYSEX_STREAM_START	0x10		// F0 7D 10 F7 -> register stream mode until 0x66
+#define SYSEX_TIMED_START	0x20		// F0 7D 20 ll hh F7 -> timed notes, hhll ms lookahead
+#define SYSEX_TIMED_STOP	0x21		// F0 7D 21 F7 -> play notes as they arrive again
+#define SYSEX_BENCH_REQUEST	0x30		// F0 7D 30 F7 -> reply F0 7D 30 <counters> F7 (BENCH builds)
+#define SYSEX_BENCH_RESET	0x31		// F0 7D 31 F7 (BENCH builds)
+
+#define RX_BUFFER_SIZE	64				// Must be a power of 2
+#define EVENT_QUEUE_SIZE	8			// Must be a power of 2
+
+#define MODE_DEBOUNCE_MS	20			// Mode pin must hold a new level this long
+#define SW_DEBOUNCE_MS		20			// So must the instrument switch
+#define KBD_SCAN_MS			5			// Time between keyboard scans
 
 #define NOTE_OFFSET	36
 #define KEYBOARD_VOL (0x2F)
 
+// Sleep until the next interrupt, or not at all if "busy" says there is work. The
+// check runs with interrupts off, and the instruction after EA = 1 always runs
+// before one is taken, so one that lands after the check still wakes the CPU.
+#ifdef BENCH
+#define IDLE()						// Only CPU time is being measured
+#define IDLE_UNLESS(busy)
+#else
+#define IDLE()		(PCON |= 0x01)
+#define IDLE_UNLESS(busy)	do { EA = 0; if(busy) EA = 1; else { EA = 1; PCON |= 0x01; } } while(0)
+#endif
+
 //-------------------------------------------------------------------------------------------
 // Global Vars
 //-------------------------------------------------------------------------------------------
@@ -41,9 +91,20 @@ typedef enum {
 	WAITING, 
 	ONE_BYTE, 
 	TWO_BYTES,
+	SYSEX,
+	TIMESTAMP_LSB,
+	TIMESTAMP_MSB,
+	STREAM,
 	KEYBOARD_MODE
 } state_t;
 
+// Posted by the ISRs, handled in order by the main loop
+typedef enum {
+	EVENT_MIDI_MODE,
+	EVENT_KEYBOARD_MODE,
+	EVENT_NEXT_INSTRUMENT
+} event_t;
+
 typedef struct {
 	uint8_t opcode;
 	uint8_t instrument;
@@ -51,37 +112,96 @@ typedef struct {
 	uint8_t vol;
 } message_t;
 
-state_t state = WAITING;
-message_t message;
+// Placement: state touched on every byte, note or interrupt is in data, arrays that
+// are only ever indexed at run time are in idata (same @Ri access, and it leaves
+// room in data), and buffers and anything cold are in xdata. tools/memreport.sh
+// checks the totals.
+__data state_t state = WAITING;
+__data message_t message;
+
+__xdata uint8_t sysexBuffer[SYSEX_MAX_LEN];
+__xdata uint8_t sysexLen;
+
+// Timed mode: notes are queued for the tick given by the last timestamp
+__data uint8_t timedMode;
+__data uint16_t timestamp;
+__data uint16_t timedDue;
+__data state_t timestampReturn;		// Where the FSM was when the timestamp came in
+
+// UART0 receive ring buffer, filled by UART0_ISR
+__xdata uint8_t rxBuffer[RX_BUFFER_SIZE];
+__data volatile uint8_t rxHead;
+__data volatile uint8_t rxCount;
+__data uint8_t rxTail;
+volatile __bit txReady;
+
+// Event queue. Indices run free, head - tail is the number waiting
+__idata volatile uint8_t eventQueue[EVENT_QUEUE_SIZE];
+__data volatile uint8_t eventHead;
+__data uint8_t eventTail;
+
+#define POST_EVENT(e) do { \
+	if((uint8_t)(eventHead - eventTail) != EVENT_QUEUE_SIZE) \
+	{ \
+		eventQueue[eventHead & (EVENT_QUEUE_SIZE - 1)] = (e); \
+		++eventHead; \
+	} } while(0)
 
-keyboard_t keyboard;
+__idata keyboard_t keyboard;		// Only reached through a pointer
 
-uint16_t T2_Overflows;
-uint16_t keysPressed;
-inst_t kbdInstrument = piano;
+__data uint16_t T2_Overflows;
+__data volatile uint16_t sampleClock;
+__data volatile uint16_t msClock;
+__data uint16_t msFraction;
+__data uint8_t modTickCount;
+volatile __bit modTick;				// Set by Timer 3 every control tick
+volatile __bit t3Fast;				// Timer 3 is ticking at the sample rate
+volatile __bit modePin;				// Debounced mode pin, kept by Timer 3
+__data uint8_t modeDebounce;
+volatile __bit swPin;				// Debounced instrument switch, kept by Timer 3
+__data uint8_t swDebounce;
+__xdata uint16_t lastScan;
+__xdata uint16_t keysPressed;
+__xdata uint32_t bootUs;			// Time from reset to ready to play
+__xdata inst_t kbdInstrument = piano;
 
 __sbit __at (0xC8) MODE_PIN;
+__sbit __at (0x82) SW_PIN;			// P0.2, low while pressed
 
 //-------------------------------------------------------------------------------------------
 // Function PROTOTYPES
 //-------------------------------------------------------------------------------------------
 void main(void);
+unsigned char _sdcc_external_startup(void);
 
 void PORT_INIT(void);
+void OSC_START(void);
 void SYSCLK_INIT(void);
+void bootLap(uint16_t sysclkKHz);
 void UART0_INIT(void);
 void T2_INIT(void);
+void T3_INIT(void);
+void setTickRate(uint8_t fast);
 void delay_us(uint16_t waitTime);
+uint16_t getSampleClock(void);
+uint16_t getMsClock(void);
 char checkModePin(void);
+void handleEvent(event_t event);
+void flushRx(void);
 
 state_t waiting(char input);
 state_t one_byte(char input);
 state_t two_bytes(char input);
+state_t sysex(char input);
+state_t timestamp_lsb(char input);
+state_t timestamp_msb(char input);
+state_t handleSysex(void);
 
 void putchar(char c);
 char getchar(void);
 
-void SW_ISR (void) __interrupt 0;
+void UART0_ISR (void) __interrupt 4;
+void T3_ISR (void) __interrupt 14;
 
 //-------------------------------------------------------------------------------------------
 // MAIN Routine
@@ -90,30 +210,83 @@ void main (void)
 {
 	char input;
 	uint8_t i;
+	int8_t result;
+#ifdef BENCH
+	uint16_t scans = 0;
+#endif
 
     SFRPAGE = CONFIG_PAGE;
 
     PORT_INIT();                // Configure the Crossbar and GPIO.
-    SYSCLK_INIT();              // Initialize the oscillator.
+    synthHold();                // Hold the YM2413 in reset until its clock is surely up
+    modePin = checkModePin();   // Timer 3 keeps this up to date from here on
+    swPin = SW_PIN;             // Same for the instrument switch
+    SYSCLK_INIT();              // Switch to the PLL.
     UART0_INIT();               // Initialize UART0.
     T2_INIT();                  // Initialize Timer2
+    T3_INIT();                  // Initialize Timer3
 
-    synthInit();
+    synthInit();                // Let the YM2413 out of reset
+    modReset();
     initKeyboard(&keyboard);
+    if(!modePin) handleEvent(EVENT_KEYBOARD_MODE);
+    bootLap(SYSCLK / 1000);     // Ready to play
+#ifdef BENCH
+    benchInit();                // Start the cycle counters
+#endif
     
     SFRPAGE = UART0_PAGE;       // Direct the output to UART0
 
 	//while(1) testSynth();
     while(1)
     {   
-    	if(checkModePin())
+    	// Mode and instrument changes, in the order they happened
+    	while(eventTail != eventHead)
+    	{
+    		handleEvent(eventQueue[eventTail & (EVENT_QUEUE_SIZE - 1)]);
+    		++eventTail;
+    	}
+
+    	if(state != KEYBOARD_MODE)
     	{
     		// MIDI MODE
-    		if(state == KEYBOARD_MODE)
+    		if(state == STREAM)
+    		{
+    			// Register stream mode bypasses the MIDI FSM entirely. Everything due
+    			// on this sample goes out together, with the UART drained in between.
+    			for(i = 0; i < STREAM_BURST; ++i)
+    			{
+    				while(rxCount) streamPush(getchar());
+    				result = streamService(getSampleClock());
+    				if(result != STREAM_RAN) break;
+    			}
+    			if(result == STREAM_END)
+    			{
+    				// The stream may have left any register set, start clean
+    				resetSynth();
+    				modReset();
+    				setTickRate(0);
+    				state = WAITING;
+    			}
+    			// Timer 3 wakes us every sample, which is as fine as the stream gets.
+    			// After a full burst more may be due, so look at events and go again.
+    			if(result != STREAM_RAN) IDLE_UNLESS(rxCount || eventTail != eventHead);
+    			continue;
+    		}
+    		// Timed notes have to go out even when nothing is arriving
+    		if(timedMode) schedService(getMsClock());
+    		// Modulation gets fewer writes when MIDI is waiting to be handled
+    		if(modTick)
+    		{
+    			modTick = 0;
+    			modService(rxCount ? MOD_WRITES_BUSY : MOD_WRITES_IDLE);
+    		}
+    		if(!rxCount)
     		{
-    			killAll();
-    			state = WAITING;
+    			IDLE_UNLESS(rxCount || modTick || eventTail != eventHead);
+    			continue;
     		}
+
     		// Get a new byte ASAP
 	    	input = getchar();
 	    	
@@ -121,14 +294,29 @@ void main (void)
 			switch(state)
 	    	{
 	    		case WAITING:
+	    			BENCH_BEGIN(BENCH_WAITING);
 	    			state = waiting(input);
+	    			BENCH_END(BENCH_WAITING);
 	    			break;
 	    		case ONE_BYTE:
+	    			BENCH_BEGIN(BENCH_ONE_BYTE);
 	    			state = one_byte(input);
+	    			BENCH_END(BENCH_ONE_BYTE);
 	    			break;
 				case TWO_BYTES:
+					BENCH_BEGIN(BENCH_TWO_BYTES);
 					state = two_bytes(input);
+					BENCH_END(BENCH_TWO_BYTES);
 	    			break;
+				case SYSEX:
+					state = sysex(input);
+					break;
+				case TIMESTAMP_LSB:
+					state = timestamp_lsb(input);
+					break;
+				case TIMESTAMP_MSB:
+					state = timestamp_msb(input);
+					break;
 	    		default:
 	    			break;
 	    	}
@@ -137,12 +325,20 @@ void main (void)
     	else
     	{
     		// KEYBOARD MODE
-    		updateKeyboard(&keyboard);
-    		if(state != KEYBOARD_MODE)
+    		// Nothing reads MIDI here, don't let it pile up in the buffer
+    		if(rxCount) flushRx();
+#ifndef BENCH
+    		// A scan is mostly settling delays, so only do one every few ms
+    		if((uint16_t)(getMsClock() - lastScan) < KBD_SCAN_MS)
     		{
-    			killAll();
-    			state = KEYBOARD_MODE;
+    			IDLE_UNLESS(eventTail != eventHead);
+    			continue;
     		}
+    		lastScan = getMsClock();
+#endif
+    		BENCH_BEGIN(BENCH_UPDATE_KEYBOARD);
+    		updateKeyboard(&keyboard);
+    		BENCH_END(BENCH_UPDATE_KEYBOARD);
     		for(i = 0; i < NUM_KEYS; ++i)
     		{
     			// Only act if state changed
@@ -157,6 +353,19 @@ void main (void)
     					noteOff(i + NOTE_OFFSET, kbdInstrument);
     			}
     		}
+#ifdef BENCH
+    		// Nothing arrives over the UART in keyboard mode, so report after a set
+    		// number of scans
+    		if(++scans == BENCH_KBD_SCANS)
+    		{
+    			putchar(SYSEX_START);
+    			putchar(SYSEX_ID);
+    			putchar(SYSEX_BENCH_REQUEST);
+    			benchSend();
+    			putchar(SYSEX_END);
+    			benchDone();
+    		}
+#endif
     	}
     }
 }
@@ -171,6 +380,70 @@ void T2_ISR (void) __interrupt 5   // Interrupt 5 corresponds to Timer 2 Overflo
     ++T2_Overflows;             // Increment overflows
 }
 
+// Count samples for the register stream player, keep the ms clock and the control
+// tick, and watch the mode pin and the instrument switch once a ms
+void T3_ISR (void) __interrupt 14  // Interrupt 14 corresponds to Timer 3 Overflow
+{
+    SFRPAGE = TMR3_PAGE;
+    TMR3CN &= ~0x80;            // Clear overflow flag
+    if(t3Fast)
+    {
+        ++sampleClock;
+        msFraction += 1000;
+        if(msFraction < SAMPLE_RATE) return;
+        msFraction -= SAMPLE_RATE;
+    }
+    ++msClock;
+    if(++modTickCount == MOD_TICK_MS)
+    {
+        modTickCount = 0;
+        modTick = 1;
+    }
+
+    // The switch bounces, so it is sampled here rather than on an edge
+    if(SW_PIN == swPin)
+    {
+        swDebounce = 0;
+    }
+    else if(++swDebounce == SW_DEBOUNCE_MS)
+    {
+        swDebounce = 0;
+        swPin = SW_PIN;
+        if(!swPin) POST_EVENT(EVENT_NEXT_INSTRUMENT);
+    }
+#ifndef BENCH_MODE
+    // There is no pin change interrupt on this part, so sample it here
+    SFRPAGE = CONFIG_PAGE;
+    if(MODE_PIN == modePin)
+    {
+        modeDebounce = 0;
+    }
+    else if(++modeDebounce == MODE_DEBOUNCE_MS)
+    {
+        modeDebounce = 0;
+        modePin = MODE_PIN;
+        POST_EVENT(modePin ? EVENT_MIDI_MODE : EVENT_KEYBOARD_MODE);
+    }
+#endif
+}
+
+
+//-------------------------------------------------------------------------------------------
+// _sdcc_external_startup
+//-------------------------------------------------------------------------------------------
+//
+// Called by the SDCC startup code before it clears and initializes RAM, which takes
+// about 10 ms on the internal oscillator. The crystal settles during that, and the
+// boot time counts it. Returns 0 so the RAM is still initialized.
+//
+unsigned char _sdcc_external_startup(void)
+{
+    SFRPAGE = CONFIG_PAGE;
+    WDTCN   = 0xDE;             // Disable watchdog timer.
+    WDTCN   = 0xAD;
+    OSC_START();                // Start the crystal and Timer 0
+    return 0;
+}
 
 //-------------------------------------------------------------------------------------------
 // PORT_Init
@@ -185,12 +458,10 @@ void PORT_INIT(void)
     SFRPAGE_SAVE = SFRPAGE;     // Save Current SFR page.
 
     SFRPAGE = CONFIG_PAGE;
-    WDTCN   = 0xDE;             // Disable watchdog timer.
-    WDTCN   = 0xAD;
     EA      = 1;                // Enable interrupts as selected.
 
     XBR0    = 0x04;             // Enable UART0.
-    XBR1    = 0x04;             // /INT0 routed to port pin (P0.2)
+    XBR1    = 0x00;             // P0.2 stays a GPIO, Timer 3 debounces the switch on it
     XBR2    = 0x40;             // Enable Crossbar and weak pull-ups.
 
     P0MDOUT = 0x01;             // P0.0 (TX0) is configured as Push-Pull for output.
@@ -201,30 +472,64 @@ void PORT_INIT(void)
 
     P4MDOUT =  0xFE;
     P4 		|= 0x01;
-
-    EX0     = 1; 				// Enable /INT0
     
     SFRPAGE = SFRPAGE_SAVE;     // Restore SFR page.
 }
 
+//-------------------------------------------------------------------------------------------
+// OSC_START
+//-------------------------------------------------------------------------------------------
+//
+// Start the external oscillator and Timer 0, which times it and the rest of the boot
+//
+void OSC_START(void)
+{
+    // Left out of BENCH builds: simulators have no oscillator or PLL, and these
+    // SFRs are Timer 0 on an 8052
+#ifndef BENCH
+    char SFRPAGE_SAVE;
+    SFRPAGE_SAVE = SFRPAGE;     // Save Current SFR page.
+
+    SFRPAGE = TIMER01_PAGE;
+    TMOD   &= ~0x0F;
+    TMOD   |=  0x01;            // Timer0, Mode 1: 16-bit counter/timer
+    CKCON  &= ~0x0B;            // Timer0 uses SYSCLK / 12 as time base
+    TL0     = 0;
+    TH0     = 0;
+    TF0     = 0;
+    TR0     = 1;
+
+    SFRPAGE = CONFIG_PAGE;
+    OSCXCN  = 0x67;             // Start external oscillator
+
+    SFRPAGE = SFRPAGE_SAVE;     // Restore SFR page.
+#endif
+}
+
 //-------------------------------------------------------------------------------------------
 // SYSCLK_Init
 //-------------------------------------------------------------------------------------------
 //
-// Initialize the system clock
+// Initialize the system clock, once OSC_START has had the crystal going for 1 ms
 //
 void SYSCLK_INIT(void)
 {
-    int i;
-
+    // Nothing to wait for in a simulator, it runs at the SYSCLK it is given
+#ifndef BENCH
     char SFRPAGE_SAVE;
-
+    uint8_t hi;
     SFRPAGE_SAVE = SFRPAGE;     // Save Current SFR page.
 
+    SFRPAGE = TIMER01_PAGE;
+    // Wait for the oscillator to start up. TH0 is read before TL0, so a carry in
+    // between makes the count look low and the wait a little long, never short.
+    do
+    {
+        hi = TH0;
+    } while((((uint16_t)hi << 8) | TL0) < XTAL_WAIT);
     SFRPAGE = CONFIG_PAGE;
-    OSCXCN  = 0x67;             // Start external oscillator
-    for(i=0; i < 256; i++);     // Wait for the oscillator to start up.
     while(!(OSCXCN & 0x80));    // Check to see if the Crystal Oscillator Valid Flag is set.
+    bootLap(INTCLK / 1000);
     CLKSEL  = 0x01;             // SYSCLK derived from the External Oscillator circuit.
     OSCICN  = 0x00;             // Disable the internal oscillator.
 
@@ -237,11 +542,41 @@ void SYSCLK_INIT(void)
     PLL0DIV = 0x04;
     PLL0FLT = 0x01;
     PLL0MUL = 0x09;
-    for(i=0; i < 256; i++);
+    SFRPAGE = TIMER01_PAGE;
+    while(TL0 < PLL_WAIT);      // Timer 0 restarted at the switch to the crystal
+    SFRPAGE = CONFIG_PAGE;
     PLL0CN |= 0x02;
     while(!(PLL0CN & 0x10));
+    bootLap(EXTCLK / 1000);
     CLKSEL  = 0x02;             // SYSCLK derived from the PLL.
 
+    SFRPAGE = SFRPAGE_SAVE;     // Restore SFR page.
+#endif
+}
+
+//-------------------------------------------------------------------------------------------
+// bootLap
+//-------------------------------------------------------------------------------------------
+//
+// Add what Timer 0 has counted to bootUs and restart it. Called before each change to
+// SYSCLK, since that changes the rate it counts at, with the old rate in kHz.
+//
+void bootLap(uint16_t sysclkKHz)
+{
+    char SFRPAGE_SAVE;
+    uint16_t ticks;
+
+    SFRPAGE_SAVE = SFRPAGE;     // Save Current SFR page.
+
+    SFRPAGE = TIMER01_PAGE;
+    TR0     = 0;
+    ticks   = TF0 ? 0xFFFF : (((uint16_t)TH0 << 8) | TL0);
+    bootUs += (uint32_t)ticks * 12000 / sysclkKHz;
+    TL0     = 0;
+    TH0     = 0;
+    TF0     = 0;
+    TR0     = 1;
+
     SFRPAGE = SFRPAGE_SAVE;     // Restore SFR page.
 }
 
@@ -269,6 +604,7 @@ void UART0_INIT(void)
     SCON0   = 0x50;             // Set Mode 1: 8-Bit UART
     SSTA0   = 0x10;             // UART0 baud rate divide-by-two disabled (SMOD0 = 1).
     TI0     = 1;                // Indicate TX0 ready.
+    ES0     = 1;                // Enable UART0 interrupts
 
     SFRPAGE = SFRPAGE_SAVE;     // Restore SFR page.
 }
@@ -304,15 +640,80 @@ void T2_INIT(void)
     SFRPAGE = SFRPAGE_SAVE;     // Restore SFR page.
 }
 
+//-------------------------------------------------------------------------------------------
+// T3_INIT
+//-------------------------------------------------------------------------------------------
+//
+// Configure Timer 3 to auto reload once a ms, see setTickRate()
+//
+void T3_INIT(void)
+{
+    char SFRPAGE_SAVE;
+    SFRPAGE_SAVE = SFRPAGE;     // Save Current SFR page.
+    SFRPAGE = TMR3_PAGE;        // Page for Timer 3
+
+    TMR3CN  &= ~0x0F;           // Auto reload mode, timer stopped
+    TMR3CF  &= ~0x1B;           // disable output, disable decrement
+    TMR3CF  |=  0x08;           // Set to advance on SYSCLK
+
+    RCAP3L = (unsigned char)(T3_MS_PRELOAD & 0x00FF); // Configure Timer 3 Preload
+    RCAP3H = (T3_MS_PRELOAD >> 8);
+    TMR3L = RCAP3L;
+    TMR3H = RCAP3H;
+
+    TMR3CN  |= 0x04;            // Enable Timer 3
+
+    EIE2    |= 0x01;            // Enable T3 interrupts
+
+    SFRPAGE = SFRPAGE_SAVE;     // Restore SFR page.
+}
+
+//-------------------------------------------------------------------------------------------
+// setTickRate
+//-------------------------------------------------------------------------------------------
+//
+// Run Timer 3 at the 44100 Hz VGM sample rate for the register stream, or once a ms
+// otherwise so idle isn't cut short 44 times a ms for nothing
+//
+void setTickRate(uint8_t fast)
+{
+    char SFRPAGE_SAVE;
+    uint16_t preload = fast ? T3_PRELOAD : T3_MS_PRELOAD;
+    SFRPAGE_SAVE = SFRPAGE;     // Save Current SFR page.
+    SFRPAGE = TMR3_PAGE;
+
+    EIE2   &= ~0x01;            // Hold T3 interrupts while the rate changes
+    RCAP3L = (unsigned char)(preload & 0x00FF);
+    RCAP3H = (preload >> 8);
+    TMR3L = RCAP3L;             // Start a full period at the new rate
+    TMR3H = RCAP3H;
+    msFraction = 0;
+    t3Fast = fast;
+    EIE2   |= 0x01;
+
+    SFRPAGE = SFRPAGE_SAVE;     // Restore SFR page.
+}
+
 //-------------------------------------------------------------------------------------------
 // delay_us
 //-------------------------------------------------------------------------------------------
 //
-// Crude wait function using Timer 2
+// Crude wait function using Timer 2. Counts 5 us overflows, the first of which can
+// come at any point, so the wait may be up to one overflow short.
 //
 void delay_us(uint16_t waitTime)
 {
+#ifdef BENCH
+	// Only CPU time is being measured
+	(void)waitTime;
+#else
+	char SFRPAGE_SAVE;
 	T2_Overflows = 0;
+	// Timer 2 never stops, so an overflow from before now is still flagged
+	SFRPAGE_SAVE = SFRPAGE;
+	SFRPAGE = TMR2_PAGE;
+	TF2 = 0;
+	SFRPAGE = SFRPAGE_SAVE;
 	ET2 = 1;
 	if(waitTime > 5)
 	{
@@ -322,8 +723,41 @@ void delay_us(uint16_t waitTime)
 	{
 		waitTime = 1;
 	}
-	while(T2_Overflows < waitTime);
+	while(T2_Overflows < waitTime) IDLE();
 	ET2 = 0;
+#endif
+}
+
+//-------------------------------------------------------------------------------------------
+// getSampleClock
+//-------------------------------------------------------------------------------------------
+//
+// Read the 44100 Hz sample clock. Reread if T3_ISR changed it halfway through.
+//
+uint16_t getSampleClock(void)
+{
+	uint16_t now;
+	do
+	{
+		now = sampleClock;
+	} while(now != sampleClock);
+	return now;
+}
+
+//-------------------------------------------------------------------------------------------
+// getMsClock
+//-------------------------------------------------------------------------------------------
+//
+// Read the millisecond clock kept by T3_ISR
+//
+uint16_t getMsClock(void)
+{
+	uint16_t now;
+	do
+	{
+		now = msClock;
+	} while(now != msClock);
+	return now;
 }
 
 //-------------------------------------------------------------------------------------------
@@ -334,6 +768,10 @@ void delay_us(uint16_t waitTime)
 //
 char checkModePin(void)
 {
+#ifdef BENCH_MODE
+	// Nothing drives the pin in a simulator
+	return BENCH_MODE;
+#else
 	char SFRPAGE_SAVE;
 	char returnVal;
     SFRPAGE_SAVE = SFRPAGE;     // Save Current SFR page.
@@ -343,6 +781,64 @@ char checkModePin(void)
 
 	SFRPAGE = SFRPAGE_SAVE;
 	return returnVal;
+#endif
+}
+
+//-------------------------------------------------------------------------------------------
+// handleEvent
+//-------------------------------------------------------------------------------------------
+//
+// Act on an event posted by an ISR
+//
+void handleEvent(event_t event)
+{
+	switch(event)
+	{
+		case EVENT_MIDI_MODE:
+			if(state != KEYBOARD_MODE) break;
+			killAll();
+			// Start from the next byte sent, not from what arrived in keyboard mode
+			flushRx();
+			state = WAITING;
+			break;
+		case EVENT_KEYBOARD_MODE:
+			if(state == KEYBOARD_MODE) break;
+			if(state == STREAM)
+			{
+				resetSynth();
+				setTickRate(0);
+			}
+			else killAll();
+			// Anything still queued belongs to the MIDI we just left
+			flushRx();
+			schedStart(0);
+			timedMode = 0;
+			modReset();
+			state = KEYBOARD_MODE;
+			break;
+		case EVENT_NEXT_INSTRUMENT:
+			if(state != KEYBOARD_MODE) break;
+			killAll();
+			kbdInstrument = (kbdInstrument + 1) % 16;
+			if(kbdInstrument == 0) ++kbdInstrument;
+			break;
+		default:
+			break;
+	}
+}
+
+//-------------------------------------------------------------------------------------------
+// flushRx
+//-------------------------------------------------------------------------------------------
+//
+// Throw away every byte waiting in the RX buffer
+//
+void flushRx(void)
+{
+	ES0 = 0;
+	rxTail = rxHead;
+	rxCount = 0;
+	ES0 = 1;
 }
 
 //-------------------------------------------------------------------------------------------
@@ -356,6 +852,16 @@ state_t waiting(char input)
 	// If this is a status byte
 	if(input & 0x80)
 	{
+		if((uint8_t)input == SYSEX_START)
+		{
+			sysexLen = 0;
+			return SYSEX;
+		}
+		if((uint8_t)input == TIMESTAMP)
+		{
+			timestampReturn = state;
+			return TIMESTAMP_LSB;
+		}
 		if((input & 0xF0) == 0xF0)
 		{
 			return state;
@@ -371,6 +877,11 @@ state_t waiting(char input)
 			message.opcode = NOTE_OFF_OPCODE;
 			return ONE_BYTE;
 		}
+		else if((input & 0xF0) == CONTROL_CHANGE_OPCODE)
+		{
+			message.opcode = CONTROL_CHANGE_OPCODE;
+			return ONE_BYTE;
+		}
 		else
 		{
 			return WAITING;
@@ -415,25 +926,174 @@ state_t two_bytes(char input)
 	{
 		return waiting(input);
 	}
+	// In timed mode the event waits in the scheduler instead, controllers too so
+	// they stay in step with the notes around them
+	if(timedMode)
+	{
+		message.vol = input;
+		if(message.opcode == CONTROL_CHANGE_OPCODE)
+			schedPush(timedDue, getMsClock(), SCHED_CONTROL, message.note, message.instrument, input);
+		else
+			schedPush(timedDue, getMsClock(),
+				(message.opcode == NOTE_ON_OPCODE && message.vol != 0x00) ? SCHED_NOTE_ON : SCHED_NOTE_OFF,
+				message.note, message.instrument, ~message.vol);
+		return ONE_BYTE;
+	}
+	if(message.opcode == CONTROL_CHANGE_OPCODE)
+	{
+		modControl(message.instrument, message.note, input);
+		return ONE_BYTE;
+	}
 	// If we get any non-control message, set a note
-	// Assumes that the only opcodes are NOTE ON and NOTE OFF
+	// Control changes are handled above, so this is NOTE ON or NOTE OFF
 	if(message.opcode == NOTE_ON_OPCODE)
 	{
 		message.vol = input;
 		// Receiving a NOTE_ON with velocity 0 is the same as a NOTE_OFF
-		if(message.vol == 0x00) noteOff(message.note, message.instrument);
+		if(message.vol == 0x00) modNoteOff(message.note, message.instrument);
 		// Velocity in the YM2413 is inverse to what would be expected
-		else 					noteOn(message.note, message.instrument, ~message.vol);
+		else 					modNoteOn(message.note, message.instrument, ~message.vol);
 		return ONE_BYTE;
 	}
 	else
 	{
 		message.vol = input;
-		noteOff(message.note, message.instrument);
+		modNoteOff(message.note, message.instrument);
 		return ONE_BYTE;
 	}
 }
 
+//-------------------------------------------------------------------------------------------
+// sysex
+//-------------------------------------------------------------------------------------------
+//
+// FSM function for when we are inside a System Exclusive message
+//
+state_t sysex(char input)
+{
+	if((uint8_t)input == SYSEX_END)
+	{
+		return handleSysex();
+	}
+	if(input & 0x80)
+	{
+		// Realtime bytes may show up in the middle of a SysEx
+		if((uint8_t)input >= 0xF8) return SYSEX;
+		// Any other status byte ends the SysEx early
+		return waiting(input);
+	}
+	// Bodies longer than we care about are not for us, just keep the start
+	if(sysexLen < SYSEX_MAX_LEN)
+		sysexBuffer[sysexLen] = input;
+	if(sysexLen != 0xFF) ++sysexLen;
+	return SYSEX;
+}
+
+//-------------------------------------------------------------------------------------------
+// timestamp_lsb
+//-------------------------------------------------------------------------------------------
+//
+// FSM function for the low 7 bits of a timestamp
+//
+state_t timestamp_lsb(char input)
+{
+	if(input & 0x80) return waiting(input);
+	timestamp = input;
+	return TIMESTAMP_MSB;
+}
+
+//-------------------------------------------------------------------------------------------
+// timestamp_msb
+//-------------------------------------------------------------------------------------------
+//
+// FSM function for the high 7 bits of a timestamp, then carry on where we were
+//
+state_t timestamp_msb(char input)
+{
+	if(input & 0x80) return waiting(input);
+	timestamp |= (uint16_t)input << 7;
+	if(timedMode) timedDue = schedTag(timestamp, getMsClock());
+	return timestampReturn;
+}
+
+//-------------------------------------------------------------------------------------------
+// handleSysex
+//-------------------------------------------------------------------------------------------
+//
+// Act on a complete SysEx message addressed to us, returns the next FSM state
+//
+state_t handleSysex(void)
+{
+	__xdata stats_t snapshot;
+
+	if(sysexLen < 2 || sysexBuffer[0] != SYSEX_ID) return WAITING;
+
+	switch(sysexBuffer[1])
+	{
+		case SYSEX_STATS_REQUEST:
+			// Copy the counters so the UART ISR can't change them mid-reply
+			ES0 = 0;
+			snapshot = stats;
+			ES0 = 1;
+			putchar(SYSEX_START);
+			putchar(SYSEX_ID);
+			putchar(SYSEX_STATS_REQUEST);
+			statsSend(&snapshot);
+			putchar(SYSEX_END);
+			break;
+		case SYSEX_STATS_RESET:
+			ES0 = 0;
+			statsReset();
+			ES0 = 1;
+			break;
+		case SYSEX_BOOT_REQUEST:
+			putchar(SYSEX_START);
+			putchar(SYSEX_ID);
+			putchar(SYSEX_BOOT_REQUEST);
+			putchar(bootUs & 0x7F);
+			putchar((bootUs >> 7) & 0x7F);
+			putchar((bootUs >> 14) & 0x7F);
+			putchar(SYSEX_END);
+			break;
+		case SYSEX_TIMED_START:
+			if(sysexLen < 4) break;
+			schedFlush();
+			schedStart(sysexBuffer[2] | ((uint16_t)sysexBuffer[3] << 7));
+			timedDue = getMsClock();
+			timedMode = 1;
+			break;
+		case SYSEX_TIMED_STOP:
+			schedFlush();
+			timedMode = 0;
+			break;
+#ifdef BENCH
+		case SYSEX_BENCH_REQUEST:
+			putchar(SYSEX_START);
+			putchar(SYSEX_ID);
+			putchar(SYSEX_BENCH_REQUEST);
+			benchSend();
+			putchar(SYSEX_END);
+			benchDone();
+			break;
+		case SYSEX_BENCH_RESET:
+			benchReset();
+			break;
+#endif
+		case SYSEX_STREAM_START:
+			schedFlush();
+			timedMode = 0;
+			// Streams are made against a freshly reset chip, see tools/ymconv
+			resetSynth();
+			modReset();
+			setTickRate(1);
+			streamStart(getSampleClock());
+			return STREAM;
+		default:
+			break;
+	}
+	return WAITING;
+}
+
 //------------------------------------------------------------------------------------
 // putchar
 //------------------------------------------------------------------------------------
@@ -442,8 +1102,8 @@ state_t two_bytes(char input)
 //
 void putchar(char c)
 {
-    while(!TI0); 
-    TI0=0;
+    while(!txReady);
+    txReady = 0;
     SBUF0 = c;
 }
 
@@ -451,30 +1111,59 @@ void putchar(char c)
 // getchar()
 //------------------------------------------------------------------------------------
 //
-//	BLOCKING implementation of getchar
+//	BLOCKING implementation of getchar, gives up with 0xFF if we leave MIDI mode
 //
 char getchar(void)
 {
     char c;
-    while(!RI0)
-    	if(checkModePin) return 0xFF;
-    RI0 =0;
-    c = SBUF0;
+    while(!rxCount)
+    	if(!modePin) return 0xFF;
+    c = rxBuffer[rxTail];
+    rxTail = (rxTail + 1) & (RX_BUFFER_SIZE - 1);
+    ES0 = 0;
+    --rxCount;
+    ES0 = 1;
 	// Enabling echoing will send all MIDI data back - may be useful
     //putchar(c);
-    return SBUF0;
+    return c;
 }
 
 //------------------------------------------------------------------------------------
-// SW_ISR
+// UART0_ISR
 //------------------------------------------------------------------------------------
 //
-// ISR to increment the instrument
+// Move received bytes into the RX buffer and keep track of the line's health
 //
-void SW_ISR (void) __interrupt 0
+void UART0_ISR (void) __interrupt 4
 {
-	if(state != KEYBOARD_MODE) return;
-	kbdInstrument = (kbdInstrument + 1) % 16;
-	if(kbdInstrument == 0) ++kbdInstrument;
-	state = WAITING;
-}
\ No newline at end of file
+	if(RI0)
+	{
+		RI0 = 0;
+		if(SSTA0 & 0x40)
+		{
+			STAT_INC(rxOverruns);
+			SSTA0 &= ~0x40;
+		}
+		if(SSTA0 & 0x80)
+		{
+			STAT_INC(rxFramingErrors);
+			SSTA0 &= ~0x80;
+		}
+		if(rxCount == RX_BUFFER_SIZE)
+		{
+			STAT_INC(rxDropped);
+		}
+		else
+		{
+			rxBuffer[rxHead] = SBUF0;
+			rxHead = (rxHead + 1) & (RX_BUFFER_SIZE - 1);
+			++rxCount;
+			if(rxCount > stats.rxMaxDepth) stats.rxMaxDepth = rxCount;
+		}
+	}
+	if(TI0)
+	{
+		TI0 = 0;
+		txReady = 1;
+	}
+}
@@ -0,0 +1,305 @@
+/* vgm.h
+ *
+ * Ken Schmitt and Frank Sinapi
+ * MPS at RPI, Fall 2017
+ * ------------------------------------------------------------------------------------
+ * Register stream player. Instead of notes, the host sends raw YM2413 register
+ * writes with sample (44100 Hz) timing, using the VGM log commands for them:
+ *
+ *   0x51 aa dd		Write dd to YM2413 register aa
+ *   0x61 ll hh		Wait hhll samples
+ *   0x62			Wait 735 samples (1/60 s)
+ *   0x63			Wait 882 samples (1/50 s)
+ *   0x7n			Wait n+1 samples
+ *   0x66			End of stream, go back to MIDI
+ *
+ * On top of that there are short forms for the writes that make up most of a song.
+ * "v" is a voice number from 0 to 8:
+ *
+ *   0x8v			Key off voice v (clear bit 4 of register 0x20+v)
+ *   0x9v			Key on voice v (set bit 4 of register 0x20+v)
+ *   0xAv ll hh		Write ll to register 0x10+v, then hh to register 0x20+v
+ *   0xBv dd		Write dd to register 0x30+v
+ *   0xC0 varint	Wait 1 to 0x3FFF samples, 7 bits per byte, LSB first, bit 7 set
+ *					on every byte but the last
+ *
+ * The short forms take command bytes VGM uses for other chips, so a raw VGM log
+ * can't be sent as it is; tools/ymconv converts one. Other VGM commands of a fixed
+ * length are skipped whole.
+ *
+ * Bytes are buffered in XRAM and the writes are played back when the sample
+ * clock reaches them. The board sends XOFF when the buffer is nearly full and
+ * XON once it has drained, so the host never overruns it.
+ *
+ * Driver function should call streamStart() once, then feed every received byte
+ * to streamPush() and call streamService() with the current sample clock as often
+ * as it can.																		*/
+
+#ifndef VGM_H
+#define VGM_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "YM2413.h"
+#include "stats.h"
+
+//------------------------------------------------------------------------------------
+// Global Constants
+//------------------------------------------------------------------------------------
+#define STREAM_BUFFER_SIZE	4096	// Must be a power of 2
+#define STREAM_XOFF_LEVEL	(STREAM_BUFFER_SIZE - 1024)	// Room for ~90ms of line rate
+#define STREAM_XON_LEVEL	(STREAM_BUFFER_SIZE / 4)
+
+// After running dry, wait for this much data (or this many samples) before playing
+// again so a batch of writes is not dribbled out as its bytes arrive
+#define STREAM_PREFILL		256
+#define STREAM_PREFILL_WAIT	2205	// 50ms
+
+#define XON		0x11
+#define XOFF	0x13
+
+#define VGM_YM2413_WRITE	0x51
+#define VGM_WAIT			0x61
+#define VGM_WAIT_60HZ		0x62
+#define VGM_WAIT_50HZ		0x63
+#define VGM_END				0x66
+#define VGM_WAIT_SHORT		0x70
+
+#define STREAM_KEY_OFF		0x80
+#define STREAM_KEY_ON		0x90
+#define STREAM_NOTE			0xA0
+#define STREAM_INSTRUMENT	0xB0
+#define STREAM_WAIT_VARINT	0xC0
+
+#define VGM_WAIT_MAX		0x4000	// Longest wait applied in one go
+
+#define STREAM_BURST		32		// Most commands the caller should run back to back
+#define STREAM_RAN			1
+#define STREAM_END			(-1)
+
+//------------------------------------------------------------------------------------
+// Global Variables
+//------------------------------------------------------------------------------------
+__xdata static uint8_t streamBuffer[STREAM_BUFFER_SIZE];
+__data static uint16_t streamHead;
+__data static uint16_t streamTail;
+__data static uint16_t streamCount;
+
+// Sample clock value at which the next command is allowed to run
+__data static uint16_t streamDue;
+
+// Set while the host has been told to stop sending
+__data static uint8_t streamPaused;
+
+// Set while the buffer has run dry, the next command then restarts the timeline
+__data static uint8_t streamStarved;
+
+//------------------------------------------------------------------------------------
+// Static Function Prototypes
+//------------------------------------------------------------------------------------
+static uint8_t streamLength(uint8_t cmd);
+static uint8_t streamPeek(uint16_t offset);
+static void streamDrop(uint16_t len);
+
+//------------------------------------------------------------------------------------
+// streamStart
+//------------------------------------------------------------------------------------
+// Empty the stream buffer and start playing at time "now"
+void streamStart(uint16_t now)
+{
+	streamHead = 0;
+	streamTail = 0;
+	streamCount = 0;
+	streamDue = now;
+	streamPaused = 0;
+	streamStarved = 1;
+	putchar(XON);
+}
+
+//------------------------------------------------------------------------------------
+// streamPush
+//------------------------------------------------------------------------------------
+// Add a received byte to the stream buffer
+void streamPush(uint8_t input)
+{
+	if(streamCount == STREAM_BUFFER_SIZE)
+	{
+		STAT_INC(streamOverruns);
+		return;
+	}
+	streamBuffer[streamHead] = input;
+	streamHead = (streamHead + 1) & (STREAM_BUFFER_SIZE - 1);
+	++streamCount;
+
+	if(!streamPaused && streamCount >= STREAM_XOFF_LEVEL)
+	{
+		putchar(XOFF);
+		streamPaused = 1;
+	}
+}
+
+//------------------------------------------------------------------------------------
+// streamService
+//------------------------------------------------------------------------------------
+// Run the next command if its time has come. Only one command is run per call so
+// the caller can keep draining the UART in between register writes, and should call
+// again straight away while it returns STREAM_RAN: more may be due on this sample.
+// Returns STREAM_END once the end of stream command is reached, STREAM_RAN after any
+// other command and 0 if none was due.
+int8_t streamService(uint16_t now)
+{
+	uint8_t cmd;
+	uint8_t voice;
+	uint8_t len;
+	uint16_t wait = 0;
+
+	// Not time yet
+	if((int16_t)(now - streamDue) < 0) return 0;
+
+	if(streamStarved)
+	{
+		// streamDue follows the clock until data shows up, so it marks its arrival
+		if(streamCount == 0 ||
+		   (streamCount < STREAM_PREFILL && (uint16_t)(now - streamDue) < STREAM_PREFILL_WAIT))
+		{
+			if(streamCount == 0) streamDue = now;
+			return 0;
+		}
+		// Play whatever arrived now instead of rushing to catch up
+		streamDue = now;
+		streamStarved = 0;
+	}
+
+	cmd = streamPeek(0);
+	len = (cmd == STREAM_WAIT_VARINT && (streamPeek(1) & 0x80)) ? 3 : streamLength(cmd);
+	if(streamCount < len)
+	{
+		// Ran dry while something was due
+		if(!streamStarved)
+		{
+			STAT_INC(streamUnderruns);
+			streamStarved = 1;
+			streamDue = now;
+		}
+		return 0;
+	}
+
+	switch(cmd)
+	{
+		case VGM_YM2413_WRITE:
+			writeRegister(streamPeek(1), streamPeek(2));
+			break;
+		case VGM_WAIT:
+			wait = streamPeek(1) | ((uint16_t)streamPeek(2) << 8);
+			// Keep the sample clock comparison inside half its range by taking
+			// long waits in pieces, leaving the remainder in the buffer
+			if(wait > VGM_WAIT_MAX)
+			{
+				streamDue += VGM_WAIT_MAX;
+				wait -= VGM_WAIT_MAX;
+				streamBuffer[(streamTail + 1) & (STREAM_BUFFER_SIZE - 1)] = wait & 0xFF;
+				streamBuffer[(streamTail + 2) & (STREAM_BUFFER_SIZE - 1)] = wait >> 8;
+				return 0;
+			}
+			break;
+		case VGM_WAIT_60HZ:
+			wait = 735;
+			break;
+		case VGM_WAIT_50HZ:
+			wait = 882;
+			break;
+		case VGM_END:
+			streamDrop(len);
+			return STREAM_END;
+		case STREAM_WAIT_VARINT:
+			wait = streamPeek(1) & 0x7F;
+			if(len == 3) wait |= (uint16_t)(streamPeek(2) & 0x7F) << 7;
+			break;
+		default:
+			voice = cmd & 0x0F;
+			switch(cmd & 0xF0)
+			{
+				case VGM_WAIT_SHORT:
+					wait = voice + 1;
+					break;
+				case STREAM_KEY_OFF:
+					if(voice < MAX_VOICES)
+						writeRegister(0x20 + voice, regShadow[0x20 + voice] & ~0x10);
+					break;
+				case STREAM_KEY_ON:
+					if(voice < MAX_VOICES)
+						writeRegister(0x20 + voice, regShadow[0x20 + voice] | 0x10);
+					break;
+				case STREAM_NOTE:
+					if(voice < MAX_VOICES)
+					{
+						writeRegister(0x10 + voice, streamPeek(1));
+						writeRegister(0x20 + voice, streamPeek(2));
+					}
+					break;
+				case STREAM_INSTRUMENT:
+					if(voice < MAX_VOICES)
+						writeRegister(0x30 + voice, streamPeek(1));
+					break;
+				default:
+					// Another chip's command, skipped whole by streamLength()
+					break;
+			}
+			break;
+	}
+
+	streamDue += wait;
+	streamDrop(len);
+	return STREAM_RAN;
+}
+
+//------------------------------------------------------------------------------------
+// STATIC FUNCTION IMPLEMENTATIONS
+//------------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------------
+// streamLength
+//------------------------------------------------------------------------------------
+// Bytes taken by a command, opcode included. Commands of other chips get their VGM
+// length where it is fixed and doesn't clash with a short form, anything else 1.
+static uint8_t streamLength(uint8_t cmd)
+{
+	if(cmd == VGM_YM2413_WRITE || cmd == VGM_WAIT) return 3;
+	if((cmd & 0xF0) == STREAM_NOTE) return 3;
+	if((cmd & 0xF0) == STREAM_INSTRUMENT) return 2;
+	if(cmd == STREAM_WAIT_VARINT) return 2;
+	if(cmd >= 0x30 && cmd <= 0x3F) return 2;
+	if(cmd == 0x4F || cmd == 0x50) return 2;
+	if(cmd >= 0x40 && cmd <= 0x5F) return 3;
+	if(cmd == 0x68) return 12;
+	if(cmd >= 0xC1 && cmd <= 0xDF) return 4;
+	if(cmd >= 0xE0) return 5;
+	return 1;
+}
+
+//------------------------------------------------------------------------------------
+// streamPeek
+//------------------------------------------------------------------------------------
+// Look at a buffered byte without removing it
+static uint8_t streamPeek(uint16_t offset)
+{
+	return streamBuffer[(streamTail + offset) & (STREAM_BUFFER_SIZE - 1)];
+}
+
+//------------------------------------------------------------------------------------
+// streamDrop
+//------------------------------------------------------------------------------------
+// Remove "len" bytes from the buffer, letting the host resume once there is room
+static void streamDrop(uint16_t len)
+{
+	streamTail = (streamTail + len) & (STREAM_BUFFER_SIZE - 1);
+	streamCount -= len;
+
+	if(streamPaused && streamCount <= STREAM_XON_LEVEL)
+	{
+		putchar(XON);
+		streamPaused = 0;
+	}
+}
+
+#endif /* VGM_H */
@@ -0,0 +1,109 @@
+#!/bin/sh
+# bench.sh
+#
+# Cycle benchmarks of the firmware's hot paths, run under the ucsim 8051 simulator
+# that comes with SDCC.
+#
+# The firmware is built twice with -DBENCH (see source/bench.h): once pinned to MIDI
+# mode, where each scenario's MIDI is fed into UART0 from a file, and once pinned to
+# keyboard mode, where it reports after a fixed number of keyboard scans. Each run
+# stops at benchDone() and the counters sent over the UART are turned into cycles
+# per call, per input byte and per note event.
+#
+# Results go to _bench/results.txt. If tools/bench/baseline.txt exists, any counter
+# that got more than TOLERANCE percent slower per call fails the run. Use --save to
+# make the current results the baseline. A baseline only holds for the S51_CPU it
+# was made with, which is recorded in it.
+#
+# This script has not been run yet: SDCC and ucsim were not available where it was
+# written, so there is no baseline and the regression check has nothing to check
+# against until someone with both tools runs it with --save.
+#
+# Usage: tools/bench/bench.sh [--save]
+#
+# Environment:
+#   SDCC        sdcc binary (default sdcc)
+#   SDCC_FLAGS  compiler flags (default -mmcs51 --model-small)
+#   S51         ucsim binary (default s51)
+#   S51_CPU     ucsim CPU type (default 8052, use a C8051 type if your ucsim has one)
+#   TOLERANCE   allowed slowdown in percent (default 5)
+#
+# Counts are in ticks of Timer 0. With the default 8052 CPU type that is a machine
+# cycle of 12 clocks, since an 8052 has no CKCON to run Timer 0 from SYSCLK; on the
+# board, or a ucsim CPU type that models CKCON, it is a SYSCLK cycle. Bus delays are
+# compiled out of BENCH builds, so only CPU time is counted.
+
+set -e
+
+HERE=$(cd "$(dirname "$0")" && pwd)
+ROOT=$(cd "$HERE/../.." && pwd)
+OUT=$ROOT/_bench
+
+SDCC=${SDCC:-sdcc}
+SDCC_FLAGS=${SDCC_FLAGS:-"-mmcs51 --model-small"}
+S51=${S51:-s51}
+S51_CPU=${S51_CPU:-8052}
+TOLERANCE=${TOLERANCE:-5}
+
+mkdir -p "$OUT"
+gcc -O2 -Wall -o "$OUT/benchgen" "$HERE/benchgen.c"
+
+# build <name> <BENCH_MODE>
+build() {
+	mkdir -p "$OUT/$1"
+	$SDCC $SDCC_FLAGS -DBENCH -DBENCH_MODE=$2 -I"$ROOT/source" \
+		-o "$OUT/$1/" "$ROOT/source/synth.c"
+}
+
+# run <build> <scenario> <input file>
+run() {
+	map="$OUT/$1/synth.map"
+	# sdld lists globals as "C:  000012AB  _benchDone  synth", older versions
+	# without the "C:" and module columns: take the hex field before the name
+	addr=$(awk '{ for(i = 2; i <= NF; ++i) if($i == "_benchDone" && $(i - 1) ~ /^[0-9A-Fa-f]+$/) { print $(i - 1); exit } }' "$map")
+	if [ -z "$addr" ]; then
+		echo "no _benchDone in $map" >&2
+		exit 1
+	fi
+	rm -f "$OUT/$2.out"
+	printf 'break 0x%s\nrun\nquit\n' "$addr" | \
+		timeout 600 $S51 -t "$S51_CPU" -X 49.7664M -S in="$3",out="$OUT/$2.out" \
+		"$OUT/$1/synth.ihx" > "$OUT/$2.log" 2>&1 || true
+	"$OUT/benchgen" report "$2" "$(wc -c < "$3")" < "$OUT/$2.out" >> "$OUT/results.txt"
+}
+
+build midi 1
+build keyboard 0
+
+echo "# cpu $S51_CPU" > "$OUT/results.txt"
+for scenario in single chord9 churn; do
+	"$OUT/benchgen" gen $scenario > "$OUT/$scenario.in"
+	run midi $scenario "$OUT/$scenario.in"
+done
+: > "$OUT/keyboard.in"
+run keyboard keyboard "$OUT/keyboard.in"
+
+if [ "$1" = "--save" ]; then
+	cp "$OUT/results.txt" "$HERE/baseline.txt"
+	echo "saved baseline" >&2
+	exit 0
+fi
+
+if [ -f "$HERE/baseline.txt" ]; then
+	cpu=$(awk '$1 == "#" && $2 == "cpu" { print $3 }' "$HERE/baseline.txt")
+	if [ "$cpu" != "$S51_CPU" ]; then
+		echo "baseline.txt is for S51_CPU=$cpu, not $S51_CPU" >&2
+		exit 1
+	fi
+	awk -v tol="$TOLERANCE" '
+		$1 == "#" { next }
+		NR == FNR { base[$1 " " $2] = $5; next }
+		($1 " " $2) in base && base[$1 " " $2] > 0 {
+			limit = base[$1 " " $2] * (100 + tol) / 100
+			if($5 > limit) {
+				printf("REGRESSION %s %s: %d cycles/call, baseline %d\n", $1, $2, $5, base[$1 " " $2])
+				bad = 1
+			}
+		}
+		END { exit bad }' "$HERE/baseline.txt" "$OUT/results.txt" >&2
+fi
@@ -0,0 +1,151 @@
+/* benchgen.c
+ *
+ * Ken Schmitt and Frank Sinapi
+ * MPS at RPI, Fall 2017
+ * ------------------------------------------------------------------------------------
+ * Helper for bench.sh. Writes the UART input for each benchmark scenario, and turns
+ * the cycle counters a BENCH build sends back into a report.
+ *
+ * Compiled with: gcc -O2 -Wall -o benchgen benchgen.c
+ *
+ * Usage: benchgen gen <single|chord9|churn>  > input.bin
+ *        benchgen report <scenario> <input bytes> < output.bin
+ *
+ * "report" prints a table to stderr and one line per counter to stdout:
+ *   <scenario> <counter> <calls> <cycles> <cycles per call>						*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+//------------------------------------------------------------------------------------
+// Global Constants
+//------------------------------------------------------------------------------------
+#define SYSEX_START		0xF0
+#define SYSEX_END		0xF7
+#define SYSEX_ID		0x7D
+#define SYSEX_BENCH_REQUEST	0x30
+
+#define NUM_BENCH		7		// Must match source/bench.h
+#define BENCH_BYTES		(NUM_BENCH * 8)
+
+static const char *names[NUM_BENCH] = {
+	"waiting", "one_byte", "two_bytes", "noteOn", "noteOff", "updateKeyboard", "writeRegister"
+};
+
+//------------------------------------------------------------------------------------
+// gen
+//------------------------------------------------------------------------------------
+// Write the MIDI for a scenario, ending with the request for the counters
+static int gen(const char *scenario)
+{
+	int i, j;
+
+	if(!strcmp(scenario, "single"))
+	{
+		// One note at a time, full status bytes like hairless-midiserial sends
+		for(i = 0; i < 64; ++i)
+		{
+			printf("%c%c%c", 0x90, 48 + i % 24, 100);
+			printf("%c%c%c", 0x80, 48 + i % 24, 64);
+		}
+	}
+	else if(!strcmp(scenario, "chord9"))
+	{
+		// Nine note chords under running status, released with velocity 0
+		for(i = 0; i < 32; ++i)
+		{
+			putchar(0x93);
+			for(j = 0; j < 9; ++j) printf("%c%c", 40 + i % 12 + j * 4, 100);
+			for(j = 0; j < 9; ++j) printf("%c%c", 40 + i % 12 + j * 4, 0);
+		}
+	}
+	else if(!strcmp(scenario, "churn"))
+	{
+		// Twelve notes held at once, three more than there are voices
+		putchar(0x91);
+		for(i = 0; i < 256; ++i)
+		{
+			printf("%c%c", 36 + i % 48, 90);
+			if(i >= 12) printf("%c%c", 36 + (i - 12) % 48, 0);
+		}
+	}
+	else
+	{
+		fprintf(stderr, "unknown scenario %s\n", scenario);
+		return 2;
+	}
+	printf("%c%c%c%c", SYSEX_START, SYSEX_ID, SYSEX_BENCH_REQUEST, SYSEX_END);
+	return 0;
+}
+
+//------------------------------------------------------------------------------------
+// get7
+//------------------------------------------------------------------------------------
+// Put back together a number sent as "count" 7-bit bytes, LSB first
+static uint32_t get7(const uint8_t *p, int count)
+{
+	uint32_t value = 0;
+	while(count--) value = (value << 7) | (p[count] & 0x7F);
+	return value;
+}
+
+//------------------------------------------------------------------------------------
+// report
+//------------------------------------------------------------------------------------
+static int report(const char *scenario, long inputBytes)
+{
+	uint8_t buf[65536];
+	size_t len = fread(buf, 1, sizeof(buf), stdin), i;
+	uint32_t calls[NUM_BENCH], cycles[NUM_BENCH], fsmCalls = 0, fsmCycles = 0;
+	const uint8_t *p = NULL;
+	int n;
+
+	// The reply may come after other output (printf from keyboard mode)
+	for(i = 0; i + 4 + BENCH_BYTES <= len; ++i)
+	{
+		if(buf[i] == SYSEX_START && buf[i + 1] == SYSEX_ID && buf[i + 2] == SYSEX_BENCH_REQUEST &&
+		   buf[i + 3 + BENCH_BYTES] == SYSEX_END)
+		{
+			p = buf + i + 3;
+			break;
+		}
+	}
+	if(!p)
+	{
+		fprintf(stderr, "%s: no counters in the firmware's output\n", scenario);
+		return 1;
+	}
+
+	fprintf(stderr, "%s (%ld input bytes)\n", scenario, inputBytes);
+	fprintf(stderr, "  %-16s %8s %12s %12s\n", "", "calls", "cycles", "cycles/call");
+	for(n = 0; n < NUM_BENCH; ++n)
+	{
+		calls[n] = get7(p + n * 8, 3);
+		cycles[n] = get7(p + n * 8 + 3, 5);
+		if(!calls[n]) continue;
+		fprintf(stderr, "  %-16s %8u %12u %12u\n", names[n], calls[n], cycles[n], cycles[n] / calls[n]);
+		printf("%s %s %u %u %u\n", scenario, names[n], calls[n], cycles[n], cycles[n] / calls[n]);
+		if(n <= 2)
+		{
+			fsmCalls += calls[n];
+			fsmCycles += cycles[n];
+		}
+	}
+	if(fsmCalls)
+		fprintf(stderr, "  %u cycles per byte, %u cycles per note event\n",
+			fsmCycles / fsmCalls, calls[2] ? cycles[2] / calls[2] : 0);
+	return 0;
+}
+
+//------------------------------------------------------------------------------------
+// main
+//------------------------------------------------------------------------------------
+int main(int argc, char **argv)
+{
+	if(argc == 3 && !strcmp(argv[1], "gen")) return gen(argv[2]);
+	if(argc == 4 && !strcmp(argv[1], "report")) return report(argv[2], atol(argv[3]));
+	fprintf(stderr, "usage: %s gen <scenario> | report <scenario> <input bytes>\n", argv[0]);
+	return 2;
+}
@@ -0,0 +1,36 @@
+/* c8051f120.h (host)
+ *
+ * Ken Schmitt and Frank Sinapi
+ * MPS at RPI, Fall 2017
+ * ------------------------------------------------------------------------------------
+ * Stand-in for SDCC's c8051f120.h so the driver headers in source/ can be compiled
+ * into Linux tools. The SDCC storage keywords are dropped and the SFRs the driver
+ * touches become plain variables. Bus traffic is observed through YM2413_TRACE.	*/
+
+#ifndef C8051F120_HOST_H
+#define C8051F120_HOST_H
+
+#include <stdint.h>
+
+//------------------------------------------------------------------------------------
+// SDCC keywords
+//------------------------------------------------------------------------------------
+#define __sbit		uint8_t
+#define __at(addr)
+#define __data
+#define __idata
+#define __xdata
+#define __code
+#define __bit		uint8_t
+
+//------------------------------------------------------------------------------------
+// SFRs
+//------------------------------------------------------------------------------------
+#define CONFIG_PAGE	0x0F
+
+static uint8_t SFRPAGE;
+static uint8_t P2MDOUT;
+static uint8_t P3MDOUT;
+static uint8_t P3;
+
+#endif /* C8051F120_HOST_H */
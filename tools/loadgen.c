@@ -0,0 +1,559 @@
+/* loadgen.c
+ *
+ * Ken Schmitt and Frank Sinapi
+ * MPS at RPI, Fall 2017
+ * ------------------------------------------------------------------------------------
+ * Linux tool that throws worst-case MIDI at the board to find out how much it can
+ * take before it starts losing bytes or notes.
+ *
+ * Traffic is paced to what 115200 baud can carry (or a lower event rate) so the
+ * numbers mean the same through a pseudo-terminal as through a real port. The
+ * patterns are:
+ *   storm      note on/off with a full status byte each, across all 16 channels
+ *   running    one status byte, then nothing but data bytes
+ *   realtime   running status with clock and active sensing bytes in between
+ *   retrigger  the same note switched on twice and off twice, over and over
+ *   mix        all of the above, one event each in turn
+ *
+ * Every probe interval a stats request (F0 7D 01 F7) goes out with the traffic.
+ * The board only answers once it has worked through everything sent before it, so
+ * the time to the reply, less the reply's own time on the wire, is how far the
+ * board is lagging. The counters in the last reply give the dropped bytes and
+ * notes. Counters are reset at the start of each run.
+ *
+ * Compiled with: gcc -O2 -Wall -o loadgen loadgen.c
+ *
+ * Usage: loadgen [-o device | -O] [-p pattern] [-r events_per_s] [-d seconds]
+ *                [-P probe_ms] [-s]
+ *   -o device	Serial device of the board (default /dev/ttyUSB0)
+ *   -O			Create a pseudo-terminal for the board (or a simulator) instead
+ *   -p pattern	storm, running, realtime, retrigger or mix (default mix)
+ *   -r rate	Events per second (default as fast as the line allows)
+ *   -d seconds	Length of each run (default 10)
+ *   -P ms		Time between latency probes (default 250)
+ *   -s			Sweep from 10% to 100% of line rate and report the highest rate
+ *				the board kept up with										*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+//------------------------------------------------------------------------------------
+// Global Constants
+//------------------------------------------------------------------------------------
+#define BAUDRATE		B115200
+#define LINK_RATE		11520			// Bytes per second with 8-N-1 framing
+
+#define SYSEX_START		0xF0
+#define SYSEX_END		0xF7
+#define SYSEX_ID		0x7D			// Same as the firmware
+#define SYSEX_STATS_REQUEST	0x01
+#define SYSEX_STATS_RESET	0x02
+
+#define NOTE_OFF_OPCODE	0x80
+#define NOTE_ON_OPCODE	0x90
+#define TIMING_CLOCK	0xF8
+#define ACTIVE_SENSING	0xFE
+
+#define NUM_STATS		13				// Must match source/stats.h
+#define STATS_REPLY		(3 + NUM_STATS * 3 + 1)
+#define RX_BUFFER_SIZE	64				// Must match source/synth.c
+
+#define MAX_PROBES		1024
+#define MAX_VOICES		9				// Must match source/YM2413.h
+#define MAX_HELD		(MAX_VOICES - 1)	// Notes held at once, less than the voices
+#define MIX_HELD		(MAX_VOICES - 2)	// Leaves the voices "retrigger" holds in a mix
+#define SETTLE_US		500000			// Time given to the board to catch up after a run
+
+// Counter positions in the stats reply
+#define STAT_NOTES_DROPPED		0
+#define STAT_ORPHAN_NOTE_OFFS	1
+#define STAT_RX_OVERRUNS		2
+#define STAT_RX_FRAMING_ERRORS	3
+#define STAT_RX_DROPPED			4
+#define STAT_RX_MAX_DEPTH		5
+#define STAT_REG_WRITES			6
+
+//------------------------------------------------------------------------------------
+// Typedefs
+//------------------------------------------------------------------------------------
+typedef enum {
+	STORM, RUNNING, REALTIME, RETRIGGER, MIX, NUM_PATTERNS
+} pattern_t;
+
+typedef struct {
+	uint64_t events, bytes;
+	uint64_t usec;
+	uint16_t stats[NUM_STATS];
+	uint8_t haveStats;
+	uint64_t regWrites;				// From the wrapping counter, summed over the replies
+	uint64_t latency[MAX_PROBES];
+	uint32_t probes, answered;
+} result_t;
+
+//------------------------------------------------------------------------------------
+// Global Variables
+//------------------------------------------------------------------------------------
+static const char *patternNames[NUM_PATTERNS] = { "storm", "running", "realtime", "retrigger", "mix" };
+
+static int fd;
+
+// Generator
+static uint8_t wireStatus;			// Running status the firmware is holding
+static uint8_t held[MAX_HELD][2];	// Channel and note of the notes sounding, oldest first
+static uint8_t heldLen;
+static uint8_t nextNote, nextChannel, mixTurn, retrigStep;
+
+// Outgoing bytes not written yet
+static uint8_t out[4096];
+static uint16_t outLen;
+static int16_t probeEnd[MAX_PROBES];	// Offset in "out" just past each probe queued
+static uint16_t probesQueued;
+
+// Incoming reply parser
+static uint8_t reply[STATS_REPLY];
+static uint8_t replyLen;
+
+static uint64_t probeSent[MAX_PROBES];	// When each probe finished going out
+static uint32_t probesSent, probesAnswered;
+
+static volatile sig_atomic_t quit;
+
+//------------------------------------------------------------------------------------
+// nowUs
+//------------------------------------------------------------------------------------
+static uint64_t nowUs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+//------------------------------------------------------------------------------------
+// onSignal
+//------------------------------------------------------------------------------------
+static void onSignal(int sig)
+{
+	(void)sig;
+	quit = 1;
+}
+
+//------------------------------------------------------------------------------------
+// setRaw
+//------------------------------------------------------------------------------------
+// Put a tty in raw 8-N-1 mode at the board's baud rate
+static int setRaw(int fd)
+{
+	struct termios tio;
+	if(tcgetattr(fd, &tio)) return -1;
+	cfmakeraw(&tio);
+	cfsetispeed(&tio, BAUDRATE);
+	cfsetospeed(&tio, BAUDRATE);
+	tio.c_cflag |= CLOCAL | CREAD;
+	tio.c_cflag &= ~(CSTOPB | CRTSCTS);
+	return tcsetattr(fd, TCSANOW, &tio);
+}
+
+//------------------------------------------------------------------------------------
+// openPty
+//------------------------------------------------------------------------------------
+// Create a raw pseudo-terminal, print the name of the far end and return our end.
+// The far end is kept open so the master doesn't see hangups between clients.
+static int openPty(const char *what)
+{
+	int master = posix_openpt(O_RDWR | O_NOCTTY);
+	int slave;
+	if(master < 0 || grantpt(master) || unlockpt(master)) return -1;
+	slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+	if(slave < 0 || setRaw(slave)) return -1;
+	fprintf(stderr, "%s: %s\n", what, ptsname(master));
+	return master;
+}
+
+//------------------------------------------------------------------------------------
+// put
+//------------------------------------------------------------------------------------
+static void put(uint8_t b)
+{
+	out[outLen++] = b;
+}
+
+//------------------------------------------------------------------------------------
+// putNote
+//------------------------------------------------------------------------------------
+// Queue a note on (velocity > 0) or off, with or without running status
+static void putNote(uint8_t channel, uint8_t note, uint8_t vel, uint8_t running, uint8_t realtime)
+{
+	uint8_t status = (vel ? NOTE_ON_OPCODE : NOTE_OFF_OPCODE) | channel;
+
+	// Note offs become velocity 0 note ons so running status holds
+	if(running) status = NOTE_ON_OPCODE | channel;
+	if(!running || status != wireStatus)
+	{
+		put(status);
+		wireStatus = status;
+	}
+	if(realtime) put(TIMING_CLOCK);
+	put(note);
+	if(realtime) put(ACTIVE_SENSING);
+	put(vel ? vel : (running ? 0 : 64));
+}
+
+//------------------------------------------------------------------------------------
+// putEvent
+//------------------------------------------------------------------------------------
+// Queue the next event of a pattern, holding at most maxHeld notes of the shared list
+static void putEvent(pattern_t pattern, uint8_t maxHeld)
+{
+	uint8_t running = (pattern == RUNNING || pattern == REALTIME);
+	uint8_t channel;
+
+	if(pattern == MIX)
+	{
+		putEvent(mixTurn, MIX_HELD);
+		mixTurn = (mixTurn + 1) % MIX;
+		return;
+	}
+
+	if(pattern == RETRIGGER)
+	{
+		// on, on, off, off of one note: the second on and second off hit the allocator
+		putNote(5, 60, (retrigStep < 2) ? 100 : 0, 0, 0);
+		retrigStep = (retrigStep + 1) & 3;
+		return;
+	}
+
+	// Once the held notes reach just under the voice count, alternate off and on
+	if(heldLen >= maxHeld)
+	{
+		putNote(held[0][0], held[0][1], 0, running, pattern == REALTIME);
+		memmove(held[0], held[1], (heldLen - 1) * sizeof(held[0]));
+		--heldLen;
+		++nextNote;
+		return;
+	}
+	channel = (pattern == STORM) ? nextChannel : 0;
+	nextChannel = (nextChannel + 1) & 0x0F;
+	held[heldLen][0] = channel;
+	held[heldLen][1] = 36 + (nextNote * 7) % 60;
+	putNote(channel, held[heldLen][1], 64 + (nextNote & 63), running, pattern == REALTIME);
+	++heldLen;
+	++nextNote;
+}
+
+//------------------------------------------------------------------------------------
+// putSysex
+//------------------------------------------------------------------------------------
+// Queue a one byte command for the firmware
+static void putSysex(uint8_t command)
+{
+	put(SYSEX_START);
+	put(SYSEX_ID);
+	put(command);
+	put(SYSEX_END);
+	// The FSM forgets the running status after a SysEx
+	wireStatus = 0;
+}
+
+//------------------------------------------------------------------------------------
+// putProbe
+//------------------------------------------------------------------------------------
+// Queue a stats request and remember where it ends
+static void putProbe(void)
+{
+	if(probesSent + probesQueued >= MAX_PROBES) return;
+	putSysex(SYSEX_STATS_REQUEST);
+	probeEnd[probesQueued++] = outLen;
+}
+
+//------------------------------------------------------------------------------------
+// flush
+//------------------------------------------------------------------------------------
+// Write up to "max" queued bytes, noting when any probe in them went out
+static uint64_t flush(uint16_t max)
+{
+	ssize_t n;
+	uint16_t i, j;
+	uint64_t t;
+
+	if(max > outLen) max = outLen;
+	if(!max) return 0;
+	n = write(fd, out, max);
+	if(n <= 0) return 0;
+	t = nowUs();
+
+	for(i = 0; i < probesQueued && probeEnd[i] <= n; ++i)
+		probeSent[probesSent++] = t;
+	for(j = 0; i < probesQueued; ++i, ++j)
+		probeEnd[j] = probeEnd[i] - n;
+	probesQueued = j;
+
+	memmove(out, out + n, outLen - n);
+	outLen -= n;
+	return n;
+}
+
+//------------------------------------------------------------------------------------
+// receive
+//------------------------------------------------------------------------------------
+// Read what the board sent back, and time and keep any stats replies
+static void receive(result_t *r)
+{
+	uint8_t buf[256];
+	ssize_t n, i;
+	uint64_t t, latency, wire;
+	uint8_t j;
+	uint16_t value;
+
+	n = read(fd, buf, sizeof(buf));
+	if(n <= 0) return;
+	t = nowUs();
+
+	for(i = 0; i < n; ++i)
+	{
+		if(buf[i] == SYSEX_START) replyLen = 0;
+		if(replyLen < STATS_REPLY) reply[replyLen++] = buf[i];
+		if(buf[i] != SYSEX_END) continue;
+
+		if(replyLen == STATS_REPLY && reply[1] == SYSEX_ID && reply[2] == SYSEX_STATS_REQUEST)
+		{
+			for(j = 0; j < NUM_STATS; ++j)
+			{
+				// The write counter wraps, so count up what it moved since the last reply
+				value = reply[3 + j * 3] | (reply[4 + j * 3] << 7) | (reply[5 + j * 3] << 14);
+				if(j == STAT_REG_WRITES) r->regWrites += (uint16_t)(value - r->stats[j]);
+				r->stats[j] = value;
+			}
+			r->haveStats = 1;
+
+			// Replies come back in order, so this answers the oldest probe
+			if(probesAnswered < probesSent)
+			{
+				wire = (uint64_t)STATS_REPLY * 1000000 / LINK_RATE;
+				latency = t - probeSent[probesAnswered];
+				r->latency[r->answered++] = latency > wire ? latency - wire : 0;
+				++probesAnswered;
+			}
+		}
+		replyLen = STATS_REPLY;
+	}
+}
+
+//------------------------------------------------------------------------------------
+// service
+//------------------------------------------------------------------------------------
+// Wait up to "timeoutMs" for replies, then write whatever the line allows by "now"
+static void service(result_t *r, int timeoutMs, uint64_t start, uint64_t *written)
+{
+	struct pollfd pfd = { fd, POLLIN, 0 };
+	uint64_t allowed;
+
+	if(poll(&pfd, 1, timeoutMs) > 0 && (pfd.revents & POLLIN)) receive(r);
+	allowed = (nowUs() - start) * LINK_RATE / 1000000;
+	if(allowed > *written) *written += flush(allowed - *written);
+}
+
+//------------------------------------------------------------------------------------
+// compareU64
+//------------------------------------------------------------------------------------
+static int compareU64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return (x < y) ? -1 : (x > y);
+}
+
+//------------------------------------------------------------------------------------
+// runLoad
+//------------------------------------------------------------------------------------
+// Send one pattern at "rate" events per second (0 = line rate) for "seconds"
+static void runLoad(result_t *r, pattern_t pattern, double rate, double seconds, uint32_t probeMs)
+{
+	uint64_t start, t, end, nextProbe, written = 0;
+	uint64_t dueEvents;
+
+	memset(r, 0, sizeof(*r));
+	outLen = 0;
+	probesQueued = 0;
+	probesSent = probesAnswered = 0;
+	replyLen = STATS_REPLY;
+	heldLen = 0;
+	wireStatus = 0;
+
+	// Clean slate: counters cleared, then a moment for the reset to be handled
+	putSysex(SYSEX_STATS_RESET);
+	start = nowUs();
+	while(outLen) service(r, 1, start, &written);
+	usleep(50000);
+
+	start = nowUs();
+	written = 0;
+	end = start + (uint64_t)(seconds * 1e6);
+	nextProbe = start + probeMs * 1000;
+
+	while(!quit && (t = nowUs()) < end)
+	{
+		if(t >= nextProbe)
+		{
+			putProbe();
+			nextProbe += probeMs * 1000;
+		}
+
+		// Keep a little ahead of the line at full rate, otherwise follow the clock
+		dueEvents = rate > 0 ? (uint64_t)((t - start) * rate / 1e6) : UINT64_MAX;
+		while(r->events < dueEvents && outLen < 64)
+		{
+			uint16_t before = outLen;
+			putEvent(pattern, MAX_HELD);
+			r->bytes += outLen - before;
+			++r->events;
+		}
+		service(r, 1, start, &written);
+	}
+	r->usec = nowUs() - start;
+
+	// Let everything drain, then read the counters one last time
+	while(!quit && outLen) service(r, 1, start, &written);
+	putProbe();
+	while(!quit && outLen) service(r, 1, start, &written);
+	end = nowUs() + SETTLE_US;
+	while(!quit && nowUs() < end && probesAnswered < probesSent) service(r, 10, start, &written);
+	r->probes = probesSent;
+}
+
+//------------------------------------------------------------------------------------
+// dropped
+//------------------------------------------------------------------------------------
+// Bytes and notes the board lost, according to its counters
+static uint32_t dropped(const result_t *r)
+{
+	return r->stats[STAT_RX_DROPPED] + r->stats[STAT_RX_OVERRUNS] + r->stats[STAT_RX_FRAMING_ERRORS] +
+		r->stats[STAT_NOTES_DROPPED] + r->stats[STAT_ORPHAN_NOTE_OFFS];
+}
+
+//------------------------------------------------------------------------------------
+// report
+//------------------------------------------------------------------------------------
+static void report(const char *pattern, result_t *r)
+{
+	double seconds = r->usec / 1e6;
+
+	fprintf(stderr, "pattern:     %s, %.1f s\n", pattern, seconds);
+	fprintf(stderr, "sent:        %llu events, %llu bytes (%.0f events/s, %.0f B/s, line is %u B/s)\n",
+		(unsigned long long)r->events, (unsigned long long)r->bytes,
+		r->events / seconds, r->bytes / seconds, LINK_RATE);
+	if(!r->haveStats)
+	{
+		fprintf(stderr, "result:      NO REPLY from the board\n");
+		return;
+	}
+	fprintf(stderr, "bytes lost:  %u RX buffer full, %u overruns, %u framing errors, RX buffer peak %u of %u\n",
+		r->stats[STAT_RX_DROPPED], r->stats[STAT_RX_OVERRUNS], r->stats[STAT_RX_FRAMING_ERRORS],
+		r->stats[STAT_RX_MAX_DEPTH], RX_BUFFER_SIZE);
+	fprintf(stderr, "notes lost:  %u with no free voice, %u note offs for silent notes\n",
+		r->stats[STAT_NOTES_DROPPED], r->stats[STAT_ORPHAN_NOTE_OFFS]);
+	fprintf(stderr, "bus:         %llu register writes\n", (unsigned long long)r->regWrites);
+	if(r->answered)
+	{
+		qsort(r->latency, r->answered, sizeof(uint64_t), compareU64);
+		fprintf(stderr, "latency ms:  p50 %.1f, p99 %.1f, max %.1f (%u of %u probes answered)\n",
+			r->latency[r->answered / 2] / 1000.0, r->latency[(r->answered * 99) / 100] / 1000.0,
+			r->latency[r->answered - 1] / 1000.0, r->answered, r->probes);
+	}
+	if(dropped(r))
+		fprintf(stderr, "result:      BOARD FELL BEHIND\n");
+	else
+		fprintf(stderr, "result:      sustained %.0f events/s\n", r->events / seconds);
+}
+
+//------------------------------------------------------------------------------------
+// main
+//------------------------------------------------------------------------------------
+int main(int argc, char **argv)
+{
+	const char *device = "/dev/ttyUSB0";
+	int ptyOut = 0, sweep = 0, i, step;
+	pattern_t pattern = MIX;
+	double rate = 0, seconds = 10, best = 0, lineRate;
+	uint32_t probeMs = 250;
+	static result_t r;
+
+	for(i = 1; i < argc; ++i)
+	{
+		if(!strcmp(argv[i], "-o") && i + 1 < argc) device = argv[++i];
+		else if(!strcmp(argv[i], "-O")) ptyOut = 1;
+		else if(!strcmp(argv[i], "-r") && i + 1 < argc) rate = atof(argv[++i]);
+		else if(!strcmp(argv[i], "-d") && i + 1 < argc) seconds = atof(argv[++i]);
+		else if(!strcmp(argv[i], "-P") && i + 1 < argc) probeMs = atoi(argv[++i]);
+		else if(!strcmp(argv[i], "-s")) sweep = 1;
+		else if(!strcmp(argv[i], "-p") && i + 1 < argc)
+		{
+			++i;
+			for(pattern = 0; pattern < NUM_PATTERNS && strcmp(argv[i], patternNames[pattern]); ++pattern);
+			if(pattern == NUM_PATTERNS)
+			{
+				fprintf(stderr, "unknown pattern %s\n", argv[i]);
+				return 2;
+			}
+		}
+		else
+		{
+			fprintf(stderr, "usage: %s [-o device | -O] [-p pattern] [-r events_per_s] [-d seconds] [-P probe_ms] [-s]\n", argv[0]);
+			return 2;
+		}
+	}
+	if(probeMs < 10) probeMs = 10;
+
+	if(ptyOut)
+	{
+		fd = openPty("board side");
+	}
+	else
+	{
+		fd = open(device, O_RDWR | O_NOCTTY);
+		if(fd >= 0 && setRaw(fd)) fd = -1;
+	}
+	if(fd < 0) { perror(ptyOut ? "pty" : device); return 1; }
+	if(ptyOut)
+	{
+		fprintf(stderr, "press enter once the board side is connected\n");
+		getchar();
+	}
+
+	signal(SIGINT, onSignal);
+	signal(SIGTERM, onSignal);
+
+	if(!sweep)
+	{
+		runLoad(&r, pattern, rate, seconds, probeMs);
+		report(patternNames[pattern], &r);
+		return (r.haveStats && !dropped(&r)) ? 0 : 1;
+	}
+
+	// Find the line rate of this pattern in events per second, then step up to it
+	runLoad(&r, pattern, 0, 1, 1000);
+	lineRate = r.events / (r.usec / 1e6);
+	fprintf(stderr, "%8s %10s %8s %8s %8s %8s\n", "load", "events/s", "bytes", "notes", "p99 ms", "max ms");
+	for(step = 1; step <= 10 && !quit; ++step)
+	{
+		runLoad(&r, pattern, lineRate * step / 10, seconds, probeMs);
+		if(r.answered) qsort(r.latency, r.answered, sizeof(uint64_t), compareU64);
+		fprintf(stderr, "%7d%% %10.0f %8u %8u %8.1f %8.1f%s\n", step * 10, r.events / (r.usec / 1e6),
+			r.stats[STAT_RX_DROPPED] + r.stats[STAT_RX_OVERRUNS] + r.stats[STAT_RX_FRAMING_ERRORS],
+			r.stats[STAT_NOTES_DROPPED] + r.stats[STAT_ORPHAN_NOTE_OFFS],
+			r.answered ? r.latency[(r.answered * 99) / 100] / 1000.0 : 0.0,
+			r.answered ? r.latency[r.answered - 1] / 1000.0 : 0.0,
+			!r.haveStats ? "  no reply" : (dropped(&r) ? "  lost" : ""));
+		if(r.haveStats && !dropped(&r)) best = r.events / (r.usec / 1e6);
+	}
+	fprintf(stderr, "%s: sustained %.0f events/s without losing anything\n", patternNames[pattern], best);
+	return best > 0 ? 0 : 1;
+}
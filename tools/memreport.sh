@@ -0,0 +1,232 @@
+#!/bin/sh
+# memreport.sh
+#
+# Builds the firmware with SDCC and reports how much of each 8051 memory space it
+# uses, per source file, so new features can't quietly push hot state out of the
+# fast internal RAM.
+#
+# Variables are found in the compiler's .asm output (label plus .ds / .db / .dw) and
+# charged to the file that declares them. Function parameters and locals go to the
+# file of their function. Code is charged the same way, from the function addresses
+# in the .rst listing. The totals come from the linker's .map and .mem files.
+#
+# The totals always have to fit the budgets below. If tools/membudget.txt exists,
+# any file that uses more of a space than it says also fails the run. Use --save to
+# make the current per file numbers the budget.
+#
+# Usage: tools/memreport.sh [--save]
+#
+# Environment:
+#   SDCC          sdcc binary (default sdcc)
+#   SDCC_FLAGS    compiler flags (default -mmcs51 --model-small)
+#   DATA_BUDGET   directly addressed internal RAM, of 128, incl. banks (default 120)
+#   IDATA_BUDGET  indirectly addressed internal RAM (default 64)
+#   STACK_MIN     fewest bytes the stack may be left (default 48)
+#   XDATA_BUDGET  external RAM, of 8448 on the C8051F120 (default 8192)
+#   CODE_BUDGET   flash, without code banking (default 65536)
+#
+# Locals in the overlay segment share space, so the per file data numbers can add
+# up to more than the total.
+#
+# The parsing follows SDCC's output formats. If a step finds nothing the script
+# stops rather than report an empty, passing budget, since that is what a change
+# in those formats would look like.
+
+set -e
+
+HERE=$(cd "$(dirname "$0")" && pwd)
+ROOT=$(cd "$HERE/.." && pwd)
+OUT=$ROOT/_mem
+
+SDCC=${SDCC:-sdcc}
+SDCC_FLAGS=${SDCC_FLAGS:-"-mmcs51 --model-small"}
+DATA_BUDGET=${DATA_BUDGET:-120}
+IDATA_BUDGET=${IDATA_BUDGET:-64}
+STACK_MIN=${STACK_MIN:-48}
+XDATA_BUDGET=${XDATA_BUDGET:-8192}
+CODE_BUDGET=${CODE_BUDGET:-65536}
+
+die() {
+	echo "memreport: $*" >&2
+	exit 2
+}
+
+command -v "$SDCC" >/dev/null || die "$SDCC not found, set SDCC"
+mkdir -p "$OUT"
+$SDCC $SDCC_FLAGS -I"$ROOT/source" -o "$OUT/" "$ROOT/source/synth.c"
+
+# Which file declares each function and file scope variable: "<name> <file>"
+for f in "$ROOT"/source/*.c "$ROOT"/source/*.h; do
+	awk -v file="$(basename "$f")" '
+		{ sub(/\r$/, "") }
+		/^[ \t]/ || /^(\/\/|\/\*|#|\})/ || /^$/ { next }
+		{
+			line = $0
+			sub(/\/\/.*/, "", line)
+			# Function definitions, not prototypes
+			if(line ~ /\(/ && line !~ /;[ \t]*$/ && line !~ /=/) {
+				head = substr(line, 1, index(line, "(") - 1)
+				sub(/[ \t]+$/, "", head)
+				n = split(head, w, /[ \t*]+/)
+				if(w[n] != "") print w[n], file
+				next
+			}
+			# Variables, ending in ; or starting an initialiser
+			if(line ~ /;[ \t]*$/ || line ~ /=/) {
+				sub(/[ \t]*(=.*|;.*)$/, "", line)
+				sub(/\[.*$/, "", line)
+				n = split(line, w, /[ \t*]+/)
+				if(w[n] ~ /^[A-Za-z_][A-Za-z0-9_]*$/) print w[n], file
+			}
+		}' "$f"
+done > "$OUT/owners.txt"
+[ -s "$OUT/owners.txt" ] || die "no functions or variables found in source/"
+for f in synth.asm synth.rst synth.map synth.mem; do
+	[ -s "$OUT/$f" ] || die "$SDCC did not write $f"
+done
+
+# Size of every symbol: "<space> <name> <bytes>", bits for the bit space
+awk '
+	/^[ \t]*\.area/ {
+		area = $2
+		if(area == "DSEG" || area == "OSEG" || area == "DABS") space = "data"
+		else if(area == "ISEG" || area == "IABS") space = "idata"
+		else if(area == "BSEG") space = "bits"
+		else if(area == "XSEG" || area == "XISEG" || area == "XABS" || area == "PSEG") space = "xdata"
+		else if(area == "CONST") space = "const"
+		else space = ""
+		sym = ""
+		next
+	}
+	space == "" { next }
+	/^[A-Za-z_][A-Za-z0-9_]*::?/ { sym = $1; sub(/:+$/, "", sym); next }
+	sym == "" { next }
+	$1 == ".ds" { size[space " " sym] += $2; next }
+	$1 == ".db" || $1 == ".byte" { size[space " " sym] += split($0, a, ","); next }
+	$1 == ".dw" || $1 == ".word" { size[space " " sym] += 2 * split($0, a, ","); next }
+	$1 == ".ascii" { s = $0; sub(/^[^"]*"/, "", s); sub(/"[^"]*$/, "", s); size[space " " sym] += length(s); next }
+	END { for(k in size) print k, size[k] }
+' "$OUT/synth.asm" > "$OUT/symbols.txt"
+[ -s "$OUT/symbols.txt" ] || die "no variables found in synth.asm"
+
+# Code per function, from where each function starts in the .rst listing to where the
+# next one does. The last one ends at the end of CSEG.
+awk '/^;/ && $2 == "function" { print $3 }' "$OUT/synth.asm" > "$OUT/functions.txt"
+[ -s "$OUT/functions.txt" ] || die "no functions found in synth.asm"
+awk '
+	function hex(s,   i, c, v) {
+		v = 0
+		s = toupper(s)
+		for(i = 1; i <= length(s); ++i) {
+			c = index("0123456789ABCDEF", substr(s, i, 1))
+			if(!c) return -1
+			v = v * 16 + c - 1
+		}
+		return v
+	}
+	BEGIN { n = 0; end = -1 }
+	FILENAME ~ /functions.txt$/ { isFunc["_" $1] = 1; next }
+	FILENAME ~ /synth.map$/ { if($1 == "CSEG") end = hex($2) + hex($3); next }
+	/\.area/ { for(i = 1; i < NF; ++i) if($i == ".area") inCseg = ($(i + 1) == "CSEG") }
+	inCseg && $NF ~ /^_[A-Za-z0-9_]+::?$/ {
+		name = $NF
+		sub(/:+$/, "", name)
+		if(!(name in isFunc) || hex($1) < 0) next
+		addr[n] = hex($1)
+		func[n++] = name
+	}
+	END {
+		if(end < 0) { print "memreport: no CSEG in synth.map" > "/dev/stderr"; exit 1 }
+		if(!n) { print "memreport: no function addresses in synth.rst" > "/dev/stderr"; exit 1 }
+		for(i = 0; i < n; ++i) {
+			stop = (i + 1 < n) ? addr[i + 1] : end
+			print "code", func[i], stop - addr[i]
+		}
+	}
+' "$OUT/functions.txt" "$OUT/synth.map" "$OUT/synth.rst" >> "$OUT/symbols.txt" || exit 2
+
+# Charge every symbol to a file
+awk '
+	NR == FNR { owner["_" $1] = $2; fn[$1] = 1; next }
+	{
+		space = $1; sym = $2; bytes = $3
+		file = owner[sym]
+		if(file == "") {
+			# Parameters and locals are named after their function
+			best = ""
+			for(f in fn)
+				if(index(sym, "_" f "_") == 1 && length(f) > length(best)) best = f
+			file = (best != "") ? owner["_" best] : "(other)"
+		}
+		use[file " " space] += bytes
+		files[file] = 1
+	}
+	END {
+		for(f in files) {
+			printf("%s", f)
+			split("data idata bits xdata const code", s, " ")
+			for(i = 1; i <= 6; ++i) printf(" %d", use[f " " s[i]])
+			printf("\n")
+		}
+	}
+' "$OUT/owners.txt" "$OUT/symbols.txt" | sort > "$OUT/report.txt"
+
+# Totals from the linker
+totals=$(awk '
+	$1 ~ /^[A-Z_0-9]+$/ && /bytes/ && /\(/ {
+		for(i = 1; i <= NF; ++i) if($i ~ /^[0-9]+\.$/) { n = $i; sub(/\.$/, "", n) }
+		attr = $NF
+		if($1 == "BSEG" || attr ~ /BIT/) bits += n
+		else if(attr ~ /XDATA/) xdata += n
+		else if(attr ~ /CODE/) code += n
+		else if($1 == "ISEG" || $1 == "IABS") idata += n
+		else if($1 != "SSEG") data += n
+	}
+	END { printf("%d %d %d %d %d\n", data + int((bits + 7) / 8), idata, xdata, code, bits) }
+' "$OUT/synth.map")
+set -- "$1" $totals
+data=$2 idata=$3 xdata=$4 code=$5
+[ "${code:-0}" -gt 0 ] || die "no code segments found in synth.map"
+stack=$(sed -n 's/.*with \([0-9][0-9]*\) bytes available.*/\1/p' "$OUT/synth.mem")
+
+{
+	printf "%-12s %6s %6s %6s %6s %6s %6s\n" "file" "data" "idata" "bits" "xdata" "const" "code"
+	while read file d i b x c k; do
+		printf "%-12s %6d %6d %6d %6d %6d %6d\n" "$file" "$d" "$i" "$b" "$x" "$c" "$k"
+	done < "$OUT/report.txt"
+	echo
+	printf "data  %5d of %5d bytes (registers, variables, locals, bits)\n" "$data" "$DATA_BUDGET"
+	printf "idata %5d of %5d bytes, stack has %s bytes (at least %d)\n" "$idata" "$IDATA_BUDGET" "${stack:-?}" "$STACK_MIN"
+	printf "xdata %5d of %5d bytes\n" "$xdata" "$XDATA_BUDGET"
+	printf "code  %5d of %5d bytes\n" "$code" "$CODE_BUDGET"
+} | tee "$OUT/results.txt"
+
+bad=0
+[ "$data" -le "$DATA_BUDGET" ] || { echo "OVER BUDGET data" >&2; bad=1; }
+[ "$idata" -le "$IDATA_BUDGET" ] || { echo "OVER BUDGET idata" >&2; bad=1; }
+[ -z "$stack" ] || [ "$stack" -ge "$STACK_MIN" ] || { echo "OVER BUDGET stack" >&2; bad=1; }
+[ "$xdata" -le "$XDATA_BUDGET" ] || { echo "OVER BUDGET xdata" >&2; bad=1; }
+[ "$code" -le "$CODE_BUDGET" ] || { echo "OVER BUDGET code" >&2; bad=1; }
+
+if [ "$1" = "--save" ]; then
+	cp "$OUT/report.txt" "$HERE/membudget.txt"
+	echo "saved budget" >&2
+	exit $bad
+fi
+
+if [ -f "$HERE/membudget.txt" ]; then
+	awk '
+		NR == FNR { for(i = 2; i <= 7; ++i) base[$1 " " i] = $i; known[$1] = 1; next }
+		{
+			split("- data idata bits xdata const code", s, " ")
+			for(i = 2; i <= 7; ++i) {
+				limit = ($1 in known) ? base[$1 " " i] : 0
+				if($i > limit) {
+					printf("OVER BUDGET %s %s: %d, budget %d\n", $1, s[i], $i, limit)
+					bad = 1
+				}
+			}
+		}
+		END { exit bad }' "$HERE/membudget.txt" "$OUT/report.txt" >&2 || bad=1
+fi
+exit $bad
@@ -0,0 +1,627 @@
+/* midibridge.c
+ *
+ * Ken Schmitt and Frank Sinapi
+ * MPS at RPI, Fall 2017
+ * ------------------------------------------------------------------------------------
+ * Linux bridge from a MIDI byte stream to the board's UART, replacing
+ * hairless-midiserial + loopMIDI in the capture chain.
+ *
+ * MIDI is read from a file, a FIFO, stdin, or a pseudo-terminal the bridge creates
+ * for a sequencer to write into. A standard MIDI file is played with its own timing
+ * (see smf.h). Anything else is taken as a raw MIDI byte stream and forwarded as it
+ * arrives, so a raw file goes out in one burst. On the way through it:
+ *   - drops every message the firmware would ignore anyway
+ *   - turns note offs into note ons with velocity 0 and uses running status
+ *   - sends everything that is already waiting in one write()
+ *   - optionally tags notes with their arrival time for the board's timed mode
+ *
+ * The output is a serial device at 115200 baud, or a pseudo-terminal for testing.
+ * On exit (end of input or Ctrl-C) it reports the per-event latency from reading
+ * a message to handing it to the serial driver, and the wire bytes saved.
+ *
+ * Compiled with: gcc -O2 -Wall -o midibridge midibridge.c
+ *
+ * Usage: midibridge [-o device | -O] [-I | input] [-t lookahead_ms] [-m merge_us] [-v]
+ *   -o device	Serial device to write to (default /dev/ttyUSB0)
+ *   -O			Create a pseudo-terminal to write to instead and print its name
+ *   -I			Create a pseudo-terminal for the sequencer and print its name
+ *   input		Standard MIDI file, or file or FIFO of raw MIDI, stdin if not given
+ *   -t ms		Use timed mode with this lookahead (F0 7D 20 / F9 tags)
+ *   -m us		Wait this long after a read for more events to merge (default 0)
+ *   -v			Print whatever the board sends back							*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "smf.h"
+
+//------------------------------------------------------------------------------------
+// Global Constants
+//------------------------------------------------------------------------------------
+#define BAUDRATE		B115200
+
+#define SYSEX_START		0xF0
+#define SYSEX_END		0xF7
+#define SYSEX_ID		0x7D		// Same as the firmware
+#define SYSEX_TIMED_START	0x20
+#define SYSEX_TIMED_STOP	0x21
+#define TIMESTAMP		0xF9
+
+#define NOTE_OFF_OPCODE	0x80
+#define NOTE_ON_OPCODE	0x90
+#define CONTROL_CHANGE_OPCODE	0xB0
+
+#define MAX_SYSEX		256
+#define MAX_BATCH		4096
+
+//------------------------------------------------------------------------------------
+// Typedefs
+//------------------------------------------------------------------------------------
+typedef struct {
+	uint8_t bytes[MAX_SYSEX];
+	uint16_t len;
+	uint64_t readTime;		// When the last byte of the message was read, in us
+} midi_msg_t;
+
+//------------------------------------------------------------------------------------
+// Global Variables
+//------------------------------------------------------------------------------------
+// Input parser
+static midi_msg_t msg;
+static uint8_t inStatus;		// Running status on the input side
+static uint8_t need;			// Data bytes still needed to finish "msg"
+static uint8_t inSysex;
+
+// Output side
+static uint8_t wireStatus;		// Running status the firmware is holding
+static uint8_t batch[MAX_BATCH];
+static uint16_t batchLen;
+static uint64_t batchTimes[MAX_BATCH];	// Read time of each forwarded message
+static uint16_t batchEvents;
+
+static int outFd;
+static int timed;
+static uint16_t lastTag = 0xFFFF;
+static uint64_t startTime;
+
+// Numbers for the report
+static uint64_t eventsIn, eventsOut, bytesIn, bytesOut, bytesFull, batches;
+static uint64_t *latency;
+static size_t latencyLen, latencyCap;
+
+static int sendBatch(void);
+static void showReply(int verbose);
+
+static volatile sig_atomic_t quit;
+
+//------------------------------------------------------------------------------------
+// nowUs
+//------------------------------------------------------------------------------------
+static uint64_t nowUs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+//------------------------------------------------------------------------------------
+// onSignal
+//------------------------------------------------------------------------------------
+static void onSignal(int sig)
+{
+	(void)sig;
+	quit = 1;
+}
+
+//------------------------------------------------------------------------------------
+// setRaw
+//------------------------------------------------------------------------------------
+// Put a tty in raw 8-N-1 mode at the board's baud rate
+static int setRaw(int fd)
+{
+	struct termios tio;
+	if(tcgetattr(fd, &tio)) return -1;
+	cfmakeraw(&tio);
+	cfsetispeed(&tio, BAUDRATE);
+	cfsetospeed(&tio, BAUDRATE);
+	tio.c_cflag |= CLOCAL | CREAD;
+	tio.c_cflag &= ~(CSTOPB | CRTSCTS);
+	return tcsetattr(fd, TCSANOW, &tio);
+}
+
+//------------------------------------------------------------------------------------
+// openPty
+//------------------------------------------------------------------------------------
+// Create a raw pseudo-terminal, print the name of the far end and return our end.
+// The far end is kept open so the master doesn't see hangups between clients.
+static int openPty(const char *what)
+{
+	int master = posix_openpt(O_RDWR | O_NOCTTY);
+	int slave;
+	if(master < 0 || grantpt(master) || unlockpt(master)) return -1;
+	slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+	if(slave < 0 || setRaw(slave)) return -1;
+	fprintf(stderr, "%s: %s\n", what, ptsname(master));
+	return master;
+}
+
+//------------------------------------------------------------------------------------
+// firmwareWants
+//------------------------------------------------------------------------------------
+// Would the firmware do anything with this message
+static int firmwareWants(const midi_msg_t *m)
+{
+	uint8_t status = m->bytes[0];
+	if((status & 0xF0) == NOTE_ON_OPCODE || (status & 0xF0) == NOTE_OFF_OPCODE) return 1;
+	// Mod wheel, portamento, vibrato rate, tremolo depth and reset all controllers,
+	// see source/mod.h
+	if((status & 0xF0) == CONTROL_CHANGE_OPCODE)
+		return m->bytes[1] == 1 || m->bytes[1] == 5 || m->bytes[1] == 65 || m->bytes[1] == 76 ||
+			m->bytes[1] == 92 || m->bytes[1] == 121;
+	if(status == SYSEX_START) return m->len > 2 && m->bytes[1] == SYSEX_ID;
+	return 0;
+}
+
+//------------------------------------------------------------------------------------
+// put
+//------------------------------------------------------------------------------------
+static void put(uint8_t b)
+{
+	batch[batchLen++] = b;
+}
+
+//------------------------------------------------------------------------------------
+// forward
+//------------------------------------------------------------------------------------
+// Add a complete message to the outgoing batch, as small as it can be made
+static void forward(const midi_msg_t *m)
+{
+	uint8_t status = m->bytes[0];
+	uint16_t tag, i;
+
+	++eventsIn;
+	bytesFull += m->len;
+	if(!firmwareWants(m)) return;
+	if(batchLen + m->len + 3 > MAX_BATCH) sendBatch();
+
+	if(status == SYSEX_START)
+	{
+		for(i = 0; i < m->len; ++i) put(m->bytes[i]);
+		// The firmware loses its running status after a SysEx
+		wireStatus = 0;
+	}
+	else
+	{
+		if(timed)
+		{
+			// Tag with the time the note reached us, the board plays it that far
+			// behind by its lookahead no matter how the link bunches it up
+			tag = ((m->readTime - startTime) / 1000) & 0x3FFF;
+			if(tag != lastTag)
+			{
+				put(TIMESTAMP);
+				put(tag & 0x7F);
+				put(tag >> 7);
+				lastTag = tag;
+			}
+		}
+		// Note off is the same to the firmware as note on with velocity 0,
+		// which lets a whole run of notes share one status byte
+		if((status & 0xF0) == NOTE_OFF_OPCODE)
+			status = NOTE_ON_OPCODE | (status & 0x0F);
+		if(status != wireStatus)
+		{
+			put(status);
+			wireStatus = status;
+		}
+		put(m->bytes[1]);
+		put(((m->bytes[0] & 0xF0) == NOTE_OFF_OPCODE) ? 0 : m->bytes[2]);
+	}
+	batchTimes[batchEvents++] = m->readTime;
+	++eventsOut;
+}
+
+//------------------------------------------------------------------------------------
+// parse
+//------------------------------------------------------------------------------------
+// Feed one input byte through the MIDI parser
+static void parse(uint8_t b, uint64_t t)
+{
+	++bytesIn;
+	msg.readTime = t;
+
+	if(b >= 0xF8)
+	{
+		// Realtime, can show up anywhere and doesn't disturb anything
+		midi_msg_t rt;
+		rt.bytes[0] = b;
+		rt.len = 1;
+		rt.readTime = t;
+		forward(&rt);
+		return;
+	}
+	if(b == SYSEX_START)
+	{
+		msg.bytes[0] = b;
+		msg.len = 1;
+		inSysex = 1;
+		inStatus = 0;
+		return;
+	}
+	if(b == SYSEX_END)
+	{
+		if(inSysex && msg.len < MAX_SYSEX)
+		{
+			msg.bytes[msg.len++] = b;
+			forward(&msg);
+		}
+		inSysex = 0;
+		return;
+	}
+	if(b & 0x80)
+	{
+		inSysex = 0;
+		msg.bytes[0] = b;
+		msg.len = 1;
+		if(b < 0xF0)
+		{
+			inStatus = b;
+			need = ((b & 0xE0) == 0xC0) ? 1 : 2;
+		}
+		else
+		{
+			// System common cancels running status
+			inStatus = 0;
+			need = (b == 0xF2) ? 2 : (b == 0xF1 || b == 0xF3) ? 1 : 0;
+			if(!need) forward(&msg);
+		}
+		return;
+	}
+
+	// Data byte
+	if(inSysex)
+	{
+		if(msg.len < MAX_SYSEX - 1) msg.bytes[msg.len++] = b;
+		return;
+	}
+	if(msg.len == 0 || need == 0)
+	{
+		// Start of a new message under running status
+		if(!inStatus) return;
+		msg.bytes[0] = inStatus;
+		msg.len = 1;
+		need = ((inStatus & 0xE0) == 0xC0) ? 1 : 2;
+	}
+	msg.bytes[msg.len++] = b;
+	if(--need == 0)
+	{
+		forward(&msg);
+		msg.len = 0;
+	}
+}
+
+//------------------------------------------------------------------------------------
+// sendBatch
+//------------------------------------------------------------------------------------
+// Write everything collected in one go and record how long each event took
+static int sendBatch(void)
+{
+	uint16_t i, done = 0;
+	ssize_t n;
+	uint64_t t;
+
+	while(done < batchLen)
+	{
+		n = write(outFd, batch + done, batchLen - done);
+		if(n < 0)
+		{
+			if(errno == EINTR || errno == EAGAIN) continue;
+			perror("write");
+			return -1;
+		}
+		done += n;
+	}
+	t = nowUs();
+	if(batchLen) ++batches;
+	bytesOut += batchLen;
+
+	for(i = 0; i < batchEvents; ++i)
+	{
+		if(latencyLen == latencyCap)
+		{
+			latencyCap = latencyCap ? latencyCap * 2 : 4096;
+			latency = realloc(latency, latencyCap * sizeof(uint64_t));
+			if(!latency) { perror("realloc"); exit(1); }
+		}
+		latency[latencyLen++] = t - batchTimes[i];
+	}
+	batchLen = 0;
+	batchEvents = 0;
+	return 0;
+}
+
+//------------------------------------------------------------------------------------
+// compareU64
+//------------------------------------------------------------------------------------
+static int compareU64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return (x < y) ? -1 : (x > y);
+}
+
+//------------------------------------------------------------------------------------
+// report
+//------------------------------------------------------------------------------------
+static void report(void)
+{
+	uint64_t sum = 0;
+	size_t i;
+
+	fprintf(stderr, "events:      %llu in, %llu forwarded, %llu dropped, %llu writes\n",
+		(unsigned long long)eventsIn, (unsigned long long)eventsOut,
+		(unsigned long long)(eventsIn - eventsOut), (unsigned long long)batches);
+	fprintf(stderr, "wire bytes:  %llu out, %llu in, %llu with full status (%.0f%% saved)\n",
+		(unsigned long long)bytesOut, (unsigned long long)bytesIn, (unsigned long long)bytesFull,
+		bytesFull ? 100.0 * (1.0 - (double)bytesOut / bytesFull) : 0.0);
+	if(!latencyLen) return;
+
+	qsort(latency, latencyLen, sizeof(uint64_t), compareU64);
+	for(i = 0; i < latencyLen; ++i) sum += latency[i];
+	fprintf(stderr, "latency us:  min %llu, avg %llu, p99 %llu, max %llu\n",
+		(unsigned long long)latency[0], (unsigned long long)(sum / latencyLen),
+		(unsigned long long)latency[(latencyLen * 99) / 100],
+		(unsigned long long)latency[latencyLen - 1]);
+}
+
+//------------------------------------------------------------------------------------
+// showReply
+//------------------------------------------------------------------------------------
+// Read whatever the board says (stats replies etc.), printing it with -v
+static void showReply(int verbose)
+{
+	uint8_t buf[1024];
+	ssize_t n, i;
+
+	n = read(outFd, buf, sizeof(buf));
+	for(i = 0; verbose && i < n; ++i) fprintf(stderr, "%02X%c", buf[i], (i + 1 == n) ? '\n' : ' ');
+}
+
+//------------------------------------------------------------------------------------
+// bridge
+//------------------------------------------------------------------------------------
+// Forward a raw MIDI byte stream as it arrives, until it ends or we are stopped
+static void bridge(int in, int mergeUs, int verbose)
+{
+	int i, timeout;
+	uint8_t buf[1024];
+	ssize_t n;
+	uint64_t t, deadline;
+	struct pollfd fds[2];
+
+	fds[0].fd = in;
+	fds[0].events = POLLIN;
+	fds[1].fd = outFd;
+	fds[1].events = POLLIN;
+
+	while(!quit)
+	{
+		if(poll(fds, 2, -1) < 0)
+		{
+			if(errno == EINTR) continue;
+			perror("poll");
+			break;
+		}
+
+		if(fds[1].revents & POLLIN)
+		{
+			showReply(verbose);
+		}
+
+		if(fds[0].revents & (POLLIN | POLLHUP))
+		{
+			// Take everything that is waiting, plus anything arriving in the merge window
+			deadline = 0;
+			do
+			{
+				n = read(in, buf, sizeof(buf));
+				if(n <= 0) break;
+				t = nowUs();
+				for(i = 0; i < n; ++i) parse(buf[i], t);
+				if(!deadline) deadline = t + mergeUs;
+				timeout = (deadline > t) ? (int)((deadline - t + 999) / 1000) : 0;
+			} while(poll(fds, 1, timeout) > 0 && (fds[0].revents & POLLIN));
+
+			if(batchLen && sendBatch()) break;
+			if(n == 0 || (n < 0 && errno != EINTR && errno != EAGAIN)) break;
+		}
+	}
+}
+
+//------------------------------------------------------------------------------------
+// isSmf
+//------------------------------------------------------------------------------------
+// Is "name" a standard MIDI file rather than raw MIDI bytes
+static int isSmf(const char *name)
+{
+	struct stat st;
+	char magic[4];
+	FILE *f;
+	int result = 0;
+
+	if(stat(name, &st) || !S_ISREG(st.st_mode)) return 0;
+	f = fopen(name, "rb");
+	if(!f) return 0;
+	result = fread(magic, 1, 4, f) == 4 && !memcmp(magic, "MThd", 4);
+	fclose(f);
+	return result;
+}
+
+//------------------------------------------------------------------------------------
+// playSmf
+//------------------------------------------------------------------------------------
+// Play a standard MIDI file with its own timing. Events due at the same time go out
+// in one write. Returns -1 if the file can't be read.
+static int playSmf(const char *name, int verbose)
+{
+	FILE *f = fopen(name, "rb");
+	uint8_t *buf;
+	long size;
+	smf_event_t *events;
+	int32_t numEvents, n;
+	uint64_t start, due, t;
+	struct pollfd fd;
+
+	if(!f) { perror(name); return -1; }
+	fseek(f, 0, SEEK_END);
+	size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	buf = malloc(size);
+	if(!buf || fread(buf, 1, size, f) != (size_t)size) { perror(name); fclose(f); return -1; }
+	fclose(f);
+	numEvents = smfRead(buf, size, &events);
+	free(buf);
+	if(numEvents < 0)
+	{
+		fprintf(stderr, "%s: not a usable MIDI file\n", name);
+		return -1;
+	}
+
+	fd.fd = outFd;
+	fd.events = POLLIN;
+	start = nowUs();
+	n = 0;
+	while(n < numEvents && !quit)
+	{
+		// Wait for the next event, showing whatever the board says meanwhile
+		due = start + (uint64_t)events[n].us;
+		while(!quit && (t = nowUs()) < due)
+			if(poll(&fd, 1, (int)((due - t + 999) / 1000)) > 0 && (fd.revents & POLLIN))
+				showReply(verbose);
+
+		// Everything that is due by now goes out together
+		t = nowUs();
+		for(; n < numEvents && start + (uint64_t)events[n].us <= t; ++n)
+		{
+			smf_event_t *e = &events[n];
+			if(e->status == 0xFF) continue;
+			parse(e->status, t);
+			parse(e->data1, t);
+			if((e->status & 0xE0) != 0xC0) parse(e->data2, t);
+		}
+		if(batchLen && sendBatch()) break;
+	}
+	free(events);
+	return 0;
+}
+
+//------------------------------------------------------------------------------------
+// main
+//------------------------------------------------------------------------------------
+int main(int argc, char **argv)
+{
+	const char *device = "/dev/ttyUSB0", *inName = NULL, *smfName = NULL;
+	int ptyIn = 0, ptyOut = 0, verbose = 0, lookahead = -1, mergeUs = 0;
+	int in = -1, out, i;
+	struct stat st;
+
+	for(i = 1; i < argc; ++i)
+	{
+		if(!strcmp(argv[i], "-o") && i + 1 < argc) device = argv[++i];
+		else if(!strcmp(argv[i], "-O")) ptyOut = 1;
+		else if(!strcmp(argv[i], "-I")) ptyIn = 1;
+		else if(!strcmp(argv[i], "-t") && i + 1 < argc) lookahead = atoi(argv[++i]);
+		else if(!strcmp(argv[i], "-m") && i + 1 < argc) mergeUs = atoi(argv[++i]);
+		else if(!strcmp(argv[i], "-v")) verbose = 1;
+		else if(argv[i][0] != '-' && !inName) inName = argv[i];
+		else
+		{
+			fprintf(stderr, "usage: %s [-o device | -O] [-I | input] [-t lookahead_ms] [-m merge_us] [-v]\n", argv[0]);
+			return 2;
+		}
+	}
+	if(lookahead > 0x3FFF)
+	{
+		fprintf(stderr, "lookahead is at most %d ms\n", 0x3FFF);
+		return 2;
+	}
+
+	// Output
+	if(ptyOut)
+	{
+		out = openPty("board side");
+	}
+	else
+	{
+		out = open(device, O_RDWR | O_NOCTTY);
+		if(out >= 0 && setRaw(out)) out = -1;
+	}
+	if(out < 0) { perror(ptyOut ? "pty" : device); return 1; }
+	outFd = out;
+
+	// Input
+	if(ptyIn)
+	{
+		in = openPty("sequencer side");
+	}
+	else if(inName && isSmf(inName))
+	{
+		// Played by playSmf() instead
+		smfName = inName;
+		in = STDIN_FILENO;
+	}
+	else if(inName)
+	{
+		// Holding a FIFO open for writing too keeps it from hitting EOF between writers
+		in = (stat(inName, &st) == 0 && S_ISFIFO(st.st_mode)) ?
+			open(inName, O_RDWR) : open(inName, O_RDONLY);
+	}
+	else
+	{
+		in = STDIN_FILENO;
+	}
+	if(in < 0) { perror(inName ? inName : "pty"); return 1; }
+
+	signal(SIGINT, onSignal);
+	signal(SIGTERM, onSignal);
+	startTime = nowUs();
+
+	if(lookahead >= 0)
+	{
+		uint8_t start[] = { SYSEX_START, SYSEX_ID, SYSEX_TIMED_START,
+			lookahead & 0x7F, lookahead >> 7, SYSEX_END };
+		memcpy(batch, start, sizeof(start));
+		batchLen = sizeof(start);
+		sendBatch();
+		timed = 1;
+	}
+
+	if(smfName)
+	{
+		if(playSmf(smfName, verbose)) return 1;
+	}
+	else
+	{
+		bridge(in, mergeUs, verbose);
+	}
+
+	if(timed)
+	{
+		uint8_t stop[] = { SYSEX_START, SYSEX_ID, SYSEX_TIMED_STOP, SYSEX_END };
+		memcpy(batch, stop, sizeof(stop));
+		batchLen = sizeof(stop);
+		sendBatch();
+	}
+	tcdrain(out);
+	report();
+	return 0;
+}
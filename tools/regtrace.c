@@ -0,0 +1,590 @@
+/* regtrace.c
+ *
+ * Ken Schmitt and Frank Sinapi
+ * MPS at RPI, Fall 2017
+ * ------------------------------------------------------------------------------------
+ * Linux tool that plays MIDI through the real driver in source/YM2413.h and records
+ * every register write it puts on the bus, to catch changes to setNote(),
+ * setInstrument() or the voice allocator that change what the YM2413 hears.
+ *
+ * A trace is a text file. Each write is one line:
+ *   <event> <time in us> <addr> <data>
+ * where event 0 is resetSynth(), events 1..n are the MIDI events in order and the
+ * last one is the killAll() at the end. Modulation ticks (see source/mod.h) run
+ * every 10 ms and their writes count towards the event before them, but not
+ * towards its per-event budget. Lines starting with # are comments, except
+ * "# budget <writes> <per event>", the most bus writes the whole input and any one
+ * MIDI event are allowed to take.
+ *
+ * Inputs are standard MIDI files or one of the built-in scenarios (single, chord9,
+ * churn, programs, range, vibrato, glide, retrigger). The first three match
+ * tools/bench.
+ *
+ * Compiled with: gcc -O2 -Wall -Wno-char-subscripts -I host -I ../source -o regtrace regtrace.c -lm
+ *
+ * Usage: regtrace record <input> [trace]
+ *        regtrace check <input> <trace>
+ *        regtrace run [--save] <dir>
+ *
+ * "check" fails if the writes differ from the trace or go over its budget. "run"
+ * checks every scenario and every dir/<name>.mid against dir/<name>.trace, and with
+ * --save records them instead. Saving keeps an existing budget, or lowers it when
+ * the driver got cheaper, so a saved win cannot be given back without editing the
+ * file by hand.																	*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <dirent.h>
+#include "c8051f120.h"
+
+// Every write the driver puts on the bus goes into the trace
+static void traceWrite(uint8_t addr, uint8_t data);
+#define YM2413_TRACE(addr, data) traceWrite(addr, data)
+
+#include "YM2413.h"
+#include "mod.h"
+#include "smf.h"
+
+//------------------------------------------------------------------------------------
+// Global Constants
+//------------------------------------------------------------------------------------
+#define MAX_DIFFS		10		// Mismatched lines shown before giving up
+#define MAX_PATH		1024
+
+#define TICK_US			(MOD_TICK_MS * 1000.0)
+
+//------------------------------------------------------------------------------------
+// Typedefs
+//------------------------------------------------------------------------------------
+typedef struct {
+	uint32_t event;
+	uint32_t us;
+	uint8_t addr;
+	uint8_t data;
+} trace_t;
+
+typedef struct {
+	trace_t *writes;
+	uint32_t len, cap;
+	uint32_t events;
+	uint32_t maxPerEvent;		// Most writes made by one MIDI event
+	uint32_t budgetWrites;		// 0 when the file has no budget
+	uint32_t budgetPerEvent;
+} trace_list_t;
+
+//------------------------------------------------------------------------------------
+// Global Variables
+//------------------------------------------------------------------------------------
+static trace_list_t *recording;
+static uint32_t curEvent, curUs;
+
+static const char *scenarios[] = { "single", "chord9", "churn", "programs", "range", "vibrato", "glide", "retrigger" };
+#define NUM_SCENARIOS	(sizeof(scenarios) / sizeof(scenarios[0]))
+
+//------------------------------------------------------------------------------------
+// Function Prototypes
+//------------------------------------------------------------------------------------
+void delay_us(uint16_t waitTime);
+
+static int32_t scenario(const char *name, smf_event_t **events);
+static int32_t loadInput(const char *name, smf_event_t **events);
+static int play(const char *name, trace_list_t *t);
+static int readTrace(const char *path, trace_list_t *t);
+static int writeTrace(const char *path, const char *name, trace_list_t *t);
+static int compare(const char *name, trace_list_t *got, trace_list_t *want);
+static int record(const char *name, const char *path, trace_list_t *old);
+static int check(const char *name, const char *path);
+static int run(const char *dir, uint8_t save);
+
+//------------------------------------------------------------------------------------
+// delay_us
+//------------------------------------------------------------------------------------
+// The driver's bus timing means nothing here
+void delay_us(uint16_t waitTime)
+{
+	(void)waitTime;
+}
+
+//------------------------------------------------------------------------------------
+// traceWrite
+//------------------------------------------------------------------------------------
+// Add a register write to the trace being recorded
+static void traceWrite(uint8_t addr, uint8_t data)
+{
+	trace_list_t *t = recording;
+	if(!t) return;
+	if(t->len == t->cap)
+	{
+		t->cap = t->cap ? t->cap * 2 : 1024;
+		t->writes = realloc(t->writes, t->cap * sizeof(trace_t));
+		if(!t->writes) { perror("realloc"); exit(1); }
+	}
+	t->writes[t->len].event = curEvent;
+	t->writes[t->len].us = curUs;
+	t->writes[t->len].addr = addr;
+	t->writes[t->len].data = data;
+	++t->len;
+}
+
+//------------------------------------------------------------------------------------
+// addEvent
+//------------------------------------------------------------------------------------
+// Append a channel message to a scenario, "ms" after the start
+static void addEvent(smf_event_t **events, int32_t *len, uint32_t ms, uint8_t status, uint8_t data1, uint8_t data2)
+{
+	if(!(*len & 1023))
+	{
+		*events = realloc(*events, (*len + 1024) * sizeof(smf_event_t));
+		if(!*events) { perror("realloc"); exit(1); }
+	}
+	memset(&(*events)[*len], 0, sizeof(smf_event_t));
+	(*events)[*len].us = ms * 1000.0;
+	(*events)[*len].status = status;
+	(*events)[*len].data1 = data1;
+	(*events)[*len].data2 = data2;
+	++*len;
+}
+
+//------------------------------------------------------------------------------------
+// scenario
+//------------------------------------------------------------------------------------
+// Build one of the built-in inputs. Returns the number of events, -1 if unknown.
+static int32_t scenario(const char *name, smf_event_t **events)
+{
+	int32_t len = 0;
+	uint32_t ms = 0;
+	int i, j;
+
+	*events = NULL;
+	if(!strcmp(name, "single"))
+	{
+		// One note at a time
+		for(i = 0; i < 64; ++i, ms += 100)
+		{
+			addEvent(events, &len, ms, 0x90, 48 + i % 24, 100);
+			addEvent(events, &len, ms + 50, 0x80, 48 + i % 24, 64);
+		}
+	}
+	else if(!strcmp(name, "chord9"))
+	{
+		// Nine note chords that use every voice, released with velocity 0
+		for(i = 0; i < 32; ++i, ms += 200)
+		{
+			for(j = 0; j < 9; ++j) addEvent(events, &len, ms, 0x93, 40 + i % 12 + j * 4, 100);
+			for(j = 0; j < 9; ++j) addEvent(events, &len, ms + 100, 0x93, 40 + i % 12 + j * 4, 0);
+		}
+	}
+	else if(!strcmp(name, "churn"))
+	{
+		// Twelve notes held at once, three more than there are voices
+		for(i = 0; i < 256; ++i, ms += 20)
+		{
+			addEvent(events, &len, ms, 0x91, 36 + i % 48, 90);
+			if(i >= 12) addEvent(events, &len, ms, 0x91, 36 + (i - 12) % 48, 0);
+		}
+	}
+	else if(!strcmp(name, "programs"))
+	{
+		// Every instrument channel at a spread of velocities, with repeated notes
+		for(i = 0; i < 128; ++i, ms += 30)
+		{
+			addEvent(events, &len, ms, 0x90 | (i % 16), 60 + i % 5, 8 + (i * 37) % 120);
+			if(i >= 6) addEvent(events, &len, ms + 10, 0x80 | ((i - 6) % 16), 60 + (i - 6) % 5, 0);
+		}
+	}
+	else if(!strcmp(name, "range"))
+	{
+		// Every note the F-number table and octave math can be asked for
+		for(i = 0; i < 128; ++i, ms += 10)
+		{
+			addEvent(events, &len, ms, 0x92, i, 127);
+			addEvent(events, &len, ms + 5, 0x82, i, 0);
+		}
+	}
+	else if(!strcmp(name, "vibrato"))
+	{
+		// Held chords under the mod wheel, tremolo and rate, then everything off again
+		for(i = 0; i < 8; ++i, ms += 1000)
+		{
+			for(j = 0; j < 3; ++j) addEvent(events, &len, ms, 0x90 | j, 48 + i * 5 + j * 7, 100);
+			addEvent(events, &len, ms + 100, 0xB0, 1, i * 18);
+			addEvent(events, &len, ms + 200, 0xB1, 92, 127 - i * 18);
+			addEvent(events, &len, ms + 300, 0xB0, 76, i * 18);
+			for(j = 0; j < 3; ++j) addEvent(events, &len, ms + 900, 0x80 | j, 48 + i * 5 + j * 7, 0);
+		}
+		addEvent(events, &len, ms, 0xB0, 121, 0);
+		addEvent(events, &len, ms, 0xB1, 121, 0);
+		addEvent(events, &len, ms + 100, 0x90, 60, 100);
+		addEvent(events, &len, ms + 200, 0x80, 60, 0);
+	}
+	else if(!strcmp(name, "glide"))
+	{
+		// A mono lead with portamento: legato runs across octaves at different
+		// times, then detached notes that glide from the last one on a new voice
+		addEvent(events, &len, 0, 0xB4, 65, 127);
+		for(i = 0; i < 16; ++i, ms += 250)
+		{
+			if(!(i & 3)) addEvent(events, &len, ms, 0xB4, 5, i * 8);
+			addEvent(events, &len, ms, 0x94, 45 + (i * 7) % 25, 100);
+			if(i) addEvent(events, &len, ms + 20, 0x84, 45 + ((i - 1) * 7) % 25, 0);
+		}
+		addEvent(events, &len, ms, 0x84, 45 + (15 * 7) % 25, 0);
+		for(i = 0; i < 8; ++i, ms += 250)
+		{
+			addEvent(events, &len, ms, 0x94, 40 + i * 6, 100);
+			addEvent(events, &len, ms + 200, 0x84, 40 + i * 6, 0);
+		}
+		addEvent(events, &len, ms, 0xB4, 65, 0);
+		addEvent(events, &len, ms, 0x94, 60, 100);
+		addEvent(events, &len, ms + 200, 0x84, 60, 0);
+	}
+	else if(!strcmp(name, "retrigger"))
+	{
+		// The held note struck again under portamento, on/on/off/off, then a
+		// different note to show the voice was let go
+		addEvent(events, &len, 0, 0xB5, 65, 127);
+		for(i = 0; i < 8; ++i, ms += 300)
+		{
+			addEvent(events, &len, ms, 0x95, 50 + i * 3, 100);
+			addEvent(events, &len, ms + 50, 0x95, 50 + i * 3, 90);
+			addEvent(events, &len, ms + 150, 0x85, 50 + i * 3, 0);
+			addEvent(events, &len, ms + 200, 0x85, 50 + i * 3, 0);
+		}
+		addEvent(events, &len, ms, 0xB5, 65, 0);
+		addEvent(events, &len, ms, 0x95, 72, 100);
+		addEvent(events, &len, ms + 200, 0x85, 72, 0);
+	}
+	else
+	{
+		return -1;
+	}
+	return len;
+}
+
+//------------------------------------------------------------------------------------
+// loadInput
+//------------------------------------------------------------------------------------
+// Get the events of a scenario or a MIDI file
+static int32_t loadInput(const char *name, smf_event_t **events)
+{
+	uint8_t *buf;
+	int32_t result;
+	long size;
+	FILE *f;
+
+	result = scenario(name, events);
+	if(result >= 0) return result;
+
+	f = fopen(name, "rb");
+	if(!f) { perror(name); return -1; }
+	fseek(f, 0, SEEK_END);
+	size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	buf = malloc(size > 0 ? size : 1);
+	if(!buf || fread(buf, 1, size, f) != (size_t)size) { perror(name); fclose(f); free(buf); return -1; }
+	fclose(f);
+
+	result = smfRead(buf, size, events);
+	if(result < 0) fprintf(stderr, "%s: not a scenario or a MIDI file\n", name);
+	free(buf);
+	return result;
+}
+
+//------------------------------------------------------------------------------------
+// play
+//------------------------------------------------------------------------------------
+// Play an input through the driver and record the writes into "t"
+static int play(const char *name, trace_list_t *t)
+{
+	smf_event_t *events;
+	int32_t numEvents, n;
+	uint32_t start;
+	double nextTick = TICK_US;
+
+	numEvents = loadInput(name, &events);
+	if(numEvents < 0) return -1;
+
+	memset(t, 0, sizeof(*t));
+	recording = t;
+	curEvent = 0;
+	curUs = 0;
+	resetSynth();
+	modReset();
+
+	for(n = 0; n < numEvents; ++n)
+	{
+		smf_event_t *e = &events[n];
+
+		// Note on / note off and control change, the only messages the MIDI FSM plays
+		if((e->status & 0xE0) != 0x80 && (e->status & 0xF0) != 0xB0) continue;
+
+		// Modulation ticks up to this event count towards the event before it
+		for(; nextTick <= e->us; nextTick += TICK_US)
+		{
+			curUs = (uint32_t)llround(nextTick);
+			modService(MOD_WRITES_IDLE);
+		}
+
+		++t->events;
+		curEvent = t->events;
+		curUs = (uint32_t)llround(e->us);
+		start = t->len;
+
+		// Same handling as two_bytes() in the firmware
+		if((e->status & 0xF0) == 0xB0)
+			modControl(e->status & 0x0F, e->data1, e->data2);
+		else if((e->status & 0xF0) == 0x90 && e->data2 != 0)
+			modNoteOn(e->data1, e->status & 0x0F, (uint8_t)~e->data2);
+		else
+			modNoteOff(e->data1, e->status & 0x0F);
+
+		if(t->len - start > t->maxPerEvent) t->maxPerEvent = t->len - start;
+	}
+
+	curEvent = t->events + 1;
+	killAll();
+	recording = NULL;
+	free(events);
+	return 0;
+}
+
+//------------------------------------------------------------------------------------
+// readTrace
+//------------------------------------------------------------------------------------
+// Load a trace file. Returns -1 if it can't be read.
+static int readTrace(const char *path, trace_list_t *t)
+{
+	char line[256];
+	unsigned event, us, addr, data, writes, perEvent;
+	uint32_t lineNum = 0;
+	FILE *f;
+
+	memset(t, 0, sizeof(*t));
+	f = fopen(path, "r");
+	if(!f) return -1;
+
+	while(fgets(line, sizeof(line), f))
+	{
+		++lineNum;
+		if(line[0] == '#')
+		{
+			if(sscanf(line, "# budget %u %u", &writes, &perEvent) == 2)
+			{
+				t->budgetWrites = writes;
+				t->budgetPerEvent = perEvent;
+			}
+			continue;
+		}
+		if(line[0] == '\n' || line[0] == '\r') continue;
+		if(sscanf(line, "%u %u %x %x", &event, &us, &addr, &data) != 4)
+		{
+			fprintf(stderr, "%s:%u: bad line\n", path, lineNum);
+			fclose(f);
+			return -1;
+		}
+		if(t->len == t->cap)
+		{
+			t->cap = t->cap ? t->cap * 2 : 1024;
+			t->writes = realloc(t->writes, t->cap * sizeof(trace_t));
+			if(!t->writes) { perror("realloc"); exit(1); }
+		}
+		t->writes[t->len].event = event;
+		t->writes[t->len].us = us;
+		t->writes[t->len].addr = addr;
+		t->writes[t->len].data = data;
+		++t->len;
+	}
+	fclose(f);
+	return 0;
+}
+
+//------------------------------------------------------------------------------------
+// writeTrace
+//------------------------------------------------------------------------------------
+// Save a trace, to stdout if "path" is NULL
+static int writeTrace(const char *path, const char *name, trace_list_t *t)
+{
+	uint32_t i;
+	FILE *f = path ? fopen(path, "w") : stdout;
+
+	if(!f) { perror(path); return -1; }
+	fprintf(f, "# regtrace %s\n", name);
+	fprintf(f, "# %u events, %u writes, at most %u for one event\n", t->events, t->len, t->maxPerEvent);
+	fprintf(f, "# budget %u %u\n", t->budgetWrites, t->budgetPerEvent);
+	fprintf(f, "# event us addr data\n");
+	for(i = 0; i < t->len; ++i)
+		fprintf(f, "%u %u %02X %02X\n", t->writes[i].event, t->writes[i].us, t->writes[i].addr, t->writes[i].data);
+	if(path) fclose(f);
+	return 0;
+}
+
+//------------------------------------------------------------------------------------
+// compare
+//------------------------------------------------------------------------------------
+// Diff a fresh recording against the expected trace and check the budget.
+// Returns the number of problems found.
+static int compare(const char *name, trace_list_t *got, trace_list_t *want)
+{
+	uint32_t i, n = got->len > want->len ? got->len : want->len;
+	int diffs = 0, problems = 0;
+
+	for(i = 0; i < n; ++i)
+	{
+		trace_t *g = i < got->len ? &got->writes[i] : NULL;
+		trace_t *w = i < want->len ? &want->writes[i] : NULL;
+		if(g && w && g->event == w->event && g->us == w->us && g->addr == w->addr && g->data == w->data)
+			continue;
+		if(diffs++ < MAX_DIFFS)
+		{
+			fprintf(stderr, "%s: write %u:", name, i);
+			if(w) fprintf(stderr, " expected %u %u %02X %02X", w->event, w->us, w->addr, w->data);
+			else fprintf(stderr, " expected nothing");
+			if(g) fprintf(stderr, ", got %u %u %02X %02X\n", g->event, g->us, g->addr, g->data);
+			else fprintf(stderr, ", got nothing\n");
+		}
+	}
+	if(diffs)
+	{
+		fprintf(stderr, "%s: %d writes differ (%u expected, %u made)\n", name, diffs, want->len, got->len);
+		++problems;
+	}
+
+	if(want->budgetWrites && got->len > want->budgetWrites)
+	{
+		fprintf(stderr, "%s: OVER BUDGET, %u writes, budget %u\n", name, got->len, want->budgetWrites);
+		++problems;
+	}
+	if(want->budgetPerEvent && got->maxPerEvent > want->budgetPerEvent)
+	{
+		fprintf(stderr, "%s: OVER BUDGET, %u writes for one event, budget %u\n",
+			name, got->maxPerEvent, want->budgetPerEvent);
+		++problems;
+	}
+	if(!problems)
+		fprintf(stderr, "%s: ok, %u writes (budget %u), at most %u per event (budget %u)\n",
+			name, got->len, want->budgetWrites, got->maxPerEvent, want->budgetPerEvent);
+	return problems;
+}
+
+//------------------------------------------------------------------------------------
+// record
+//------------------------------------------------------------------------------------
+// Record the trace of an input. The budget comes from "old" when it has a lower one.
+static int record(const char *name, const char *path, trace_list_t *old)
+{
+	trace_list_t t;
+	int result = 0;
+
+	if(play(name, &t)) return 1;
+	t.budgetWrites = t.len;
+	t.budgetPerEvent = t.maxPerEvent;
+	if(old && old->budgetWrites)
+	{
+		if(t.len > old->budgetWrites || t.maxPerEvent > old->budgetPerEvent)
+		{
+			fprintf(stderr, "%s: OVER BUDGET, %u writes (budget %u), %u for one event (budget %u), not saved\n",
+				name, t.len, old->budgetWrites, t.maxPerEvent, old->budgetPerEvent);
+			free(t.writes);
+			return 1;
+		}
+	}
+	if(writeTrace(path, name, &t)) result = 1;
+	else fprintf(stderr, "%s: %u writes, at most %u per event\n", name, t.len, t.maxPerEvent);
+	free(t.writes);
+	return result;
+}
+
+//------------------------------------------------------------------------------------
+// check
+//------------------------------------------------------------------------------------
+// Compare an input against its trace file
+static int check(const char *name, const char *path)
+{
+	trace_list_t got, want;
+	int result;
+
+	if(readTrace(path, &want))
+	{
+		fprintf(stderr, "%s: can't read %s\n", name, path);
+		return 1;
+	}
+	if(play(name, &got))
+	{
+		free(want.writes);
+		return 1;
+	}
+	result = compare(name, &got, &want) ? 1 : 0;
+	free(got.writes);
+	free(want.writes);
+	return result;
+}
+
+//------------------------------------------------------------------------------------
+// run
+//------------------------------------------------------------------------------------
+// Check or save every scenario and every MIDI file in "dir"
+static int run(const char *dir, uint8_t save)
+{
+	char input[MAX_PATH], path[MAX_PATH];
+	trace_list_t old;
+	struct dirent *entry;
+	uint32_t i, failed = 0, total = 0;
+	size_t len;
+	DIR *d;
+
+	for(i = 0; i < NUM_SCENARIOS + 1; ++i)
+	{
+		d = (i == NUM_SCENARIOS) ? opendir(dir) : NULL;
+		if(i == NUM_SCENARIOS && !d) { perror(dir); return 1; }
+		do
+		{
+			if(d)
+			{
+				entry = readdir(d);
+				if(!entry) break;
+				len = strlen(entry->d_name);
+				if(len < 5 || strcmp(entry->d_name + len - 4, ".mid")) continue;
+				snprintf(input, sizeof(input), "%s/%s", dir, entry->d_name);
+				snprintf(path, sizeof(path), "%s/%.*s.trace", dir, (int)(len - 4), entry->d_name);
+			}
+			else
+			{
+				snprintf(input, sizeof(input), "%s", scenarios[i]);
+				snprintf(path, sizeof(path), "%s/%s.trace", dir, scenarios[i]);
+			}
+
+			++total;
+			if(save)
+			{
+				readTrace(path, &old);
+				if(record(input, path, &old)) ++failed;
+				free(old.writes);
+			}
+			else if(check(input, path))
+			{
+				++failed;
+			}
+		} while(d);
+		if(d) closedir(d);
+	}
+
+	fprintf(stderr, "%u of %u inputs %s\n", total - failed, total, save ? "saved" : "match");
+	return failed ? 1 : 0;
+}
+
+//------------------------------------------------------------------------------------
+// main
+//------------------------------------------------------------------------------------
+int main(int argc, char **argv)
+{
+	if(argc == 3 && !strcmp(argv[1], "record")) return record(argv[2], NULL, NULL);
+	if(argc == 4 && !strcmp(argv[1], "record")) return record(argv[2], argv[3], NULL);
+	if(argc == 4 && !strcmp(argv[1], "check")) return check(argv[2], argv[3]);
+	if(argc == 3 && !strcmp(argv[1], "run")) return run(argv[2], 0);
+	if(argc == 4 && !strcmp(argv[1], "run") && !strcmp(argv[2], "--save")) return run(argv[3], 1);
+	fprintf(stderr, "usage: %s record <input> [trace] | check <input> <trace> | run [--save] <dir>\n", argv[0]);
+	return 2;
+}
@@ -0,0 +1,179 @@
+/* smf.h
+ *
+ * Ken Schmitt and Frank Sinapi
+ * MPS at RPI, Fall 2017
+ * ------------------------------------------------------------------------------------
+ * Standard MIDI file reader shared by the host tools.
+ *
+ * smfRead() merges the channel messages of every track into one list sorted by
+ * time, with the time of each event worked out in microseconds from the tempo
+ * map (or the SMPTE division). Events at the same tick stay in track order, then
+ * in file order. SysEx and meta events other than tempo are skipped.			*/
+
+#ifndef SMF_H
+#define SMF_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+//------------------------------------------------------------------------------------
+// Typedefs
+//------------------------------------------------------------------------------------
+typedef struct {
+	uint32_t tick;
+	uint16_t track;
+	uint32_t seq;
+	double us;			// Time from the start of the file
+	uint8_t status;		// Channel message status, or 0xFF for a tempo change
+	uint8_t data1;
+	uint8_t data2;		// 0 for program change and channel pressure
+	uint32_t tempo;		// Microseconds per quarter note, tempo changes only
+} smf_event_t;
+
+//------------------------------------------------------------------------------------
+// readVarLen
+//------------------------------------------------------------------------------------
+// Read a MIDI variable length quantity
+static uint32_t readVarLen(const uint8_t *buf, uint32_t len, uint32_t *pos)
+{
+	uint32_t value = 0;
+	uint8_t b;
+	do
+	{
+		if(*pos >= len) return value;
+		b = buf[(*pos)++];
+		value = (value << 7) | (b & 0x7F);
+	} while(b & 0x80);
+	return value;
+}
+
+//------------------------------------------------------------------------------------
+// compareEvents
+//------------------------------------------------------------------------------------
+// Order merged MIDI events by time, then by track and position within the track
+static int compareEvents(const void *a, const void *b)
+{
+	const smf_event_t *x = a, *y = b;
+	if(x->tick != y->tick) return (x->tick < y->tick) ? -1 : 1;
+	if(x->track != y->track) return (x->track < y->track) ? -1 : 1;
+	return (x->seq < y->seq) ? -1 : (x->seq > y->seq);
+}
+
+//------------------------------------------------------------------------------------
+// smfRead
+//------------------------------------------------------------------------------------
+// Read every channel message of a standard MIDI file into "*events", sorted and
+// timed. Returns the number of events, or -1 if the file is bad. Tempo changes are
+// left in the list so callers can tell where they happened.
+static int32_t smfRead(const uint8_t *buf, uint32_t len, smf_event_t **events)
+{
+	smf_event_t *list = NULL;
+	uint32_t numEvents = 0, capEvents = 0;
+	uint16_t numTracks, division, track;
+	uint32_t pos, end, tick, seq = 0, metaLen, n;
+	uint32_t tempo = 500000, lastTick = 0;
+	uint8_t status = 0, type, size;
+	double us = 0;
+
+	*events = NULL;
+	if(len < 14 || memcmp(buf, "MThd", 4)) return -1;
+	numTracks = (buf[10] << 8) | buf[11];
+	division = (buf[12] << 8) | buf[13];
+	if(!division) return -1;
+	pos = 8 + ((buf[4] << 24) | (buf[5] << 16) | (buf[6] << 8) | buf[7]);
+
+	// Pull every event we care about out of every track
+	for(track = 0; track < numTracks && pos + 8 <= len; ++track)
+	{
+		if(memcmp(buf + pos, "MTrk", 4))
+		{
+			fprintf(stderr, "bad track header in track %u\n", track);
+			free(list);
+			return -1;
+		}
+		end = pos + 8 + ((buf[pos + 4] << 24) | (buf[pos + 5] << 16) | (buf[pos + 6] << 8) | buf[pos + 7]);
+		if(end > len) end = len;
+		pos += 8;
+		tick = 0;
+		status = 0;
+
+		while(pos < end)
+		{
+			tick += readVarLen(buf, end, &pos);
+			if(pos >= end) break;
+			if(buf[pos] & 0x80) status = buf[pos++];
+
+			if(numEvents == capEvents)
+			{
+				capEvents = capEvents ? capEvents * 2 : 1024;
+				list = realloc(list, capEvents * sizeof(smf_event_t));
+				if(!list) { perror("realloc"); exit(1); }
+			}
+			memset(&list[numEvents], 0, sizeof(smf_event_t));
+			list[numEvents].tick = tick;
+			list[numEvents].track = track;
+			list[numEvents].seq = seq++;
+
+			if(status == 0xFF)
+			{
+				// A meta event cut short by the end of the track ends the track
+				if(pos >= end) break;
+				type = buf[pos++];
+				metaLen = readVarLen(buf, end, &pos);
+				if(metaLen > end - pos) break;
+				if(type == 0x51 && metaLen == 3 && pos + 3 <= end)
+				{
+					list[numEvents].status = 0xFF;
+					list[numEvents].tempo = (buf[pos] << 16) | (buf[pos + 1] << 8) | buf[pos + 2];
+					++numEvents;
+				}
+				pos += metaLen;
+				status = 0;
+			}
+			else if(status == 0xF0 || status == 0xF7)
+			{
+				metaLen = readVarLen(buf, end, &pos);
+				if(metaLen > end - pos) break;
+				pos += metaLen;
+				status = 0;
+			}
+			else if(status & 0x80)
+			{
+				size = ((status & 0xF0) == 0xC0 || (status & 0xF0) == 0xD0) ? 1 : 2;
+				if(pos + size > end) break;
+				list[numEvents].status = status;
+				list[numEvents].data1 = buf[pos];
+				if(size == 2) list[numEvents].data2 = buf[pos + 1];
+				++numEvents;
+				pos += size;
+			}
+			else
+			{
+				fprintf(stderr, "data byte with no running status in track %u\n", track);
+				break;
+			}
+		}
+		pos = end;
+	}
+
+	qsort(list, numEvents, sizeof(smf_event_t), compareEvents);
+
+	// Tempo changes apply to everything after them, whichever track they are in
+	for(n = 0; n < numEvents; ++n)
+	{
+		if(division & 0x8000)
+			us += (list[n].tick - lastTick) * 1e6 / ((0x100 - (division >> 8)) * (division & 0xFF));
+		else
+			us += (list[n].tick - lastTick) * (double)tempo / division;
+		lastTick = list[n].tick;
+		list[n].us = us;
+		if(list[n].status == 0xFF) tempo = list[n].tempo;
+	}
+
+	*events = list;
+	return numEvents;
+}
+
+#endif /* SMF_H */
@@ -0,0 +1,613 @@
+/* ymconv.c
+ *
+ * Ken Schmitt and Frank Sinapi
+ * MPS at RPI, Fall 2017
+ * ------------------------------------------------------------------------------------
+ * Linux tool to convert a VGM log or a standard MIDI file into the register stream
+ * format played by the board (see source/vgm.h).
+ *
+ * MIDI files are played through the real driver in source/YM2413.h, so the voice
+ * allocation is exactly what the board would do with the same notes. VGM files
+ * have their YM2413 writes taken as they are.
+ *
+ * The stream is kept small so it fits through 115200 baud:
+ *   - writes that would not change a register are dropped
+ *   - waits use the shortest form that fits (0x7n, 0x62/0x63, varint, 0x61)
+ *   - key on/off, F-number and instrument writes use the short per-voice opcodes
+ *
+ * A report goes to stderr with the bytes per second needed, and a simulation of the
+ * link and the board's 4 KB buffer to check the stream plays without running dry.
+ *
+ * Compiled with: gcc -O2 -Wall -Wno-char-subscripts -I host -I ../source -o ymconv ymconv.c -lm
+ *
+ * Usage: ymconv [-r] [-o output] input.vgm|input.mid
+ *   -r   Leave out the F0 7D 10 F7 that puts the board in register stream mode	*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include "c8051f120.h"
+
+// Every write the driver puts on the bus goes through the encoder
+static void traceWrite(uint8_t addr, uint8_t data);
+#define YM2413_TRACE(addr, data) traceWrite(addr, data)
+
+#include "YM2413.h"
+#include "vgm.h"
+#include "mod.h"
+#include "smf.h"
+
+//------------------------------------------------------------------------------------
+// Global Constants
+//------------------------------------------------------------------------------------
+#define SAMPLE_RATE		44100
+#define TICK_SAMPLES	(MOD_TICK_MS * SAMPLE_RATE / 1000)	// Samples per control tick
+#define LINK_BAUD		115200
+#define LINK_RATE		(LINK_BAUD / 10)	// Bytes per second with 8-N-1 framing
+#define WRITE_TIME_US	35					// Board time per register write incl. settle
+
+#define MAX_BATCH		256
+
+//------------------------------------------------------------------------------------
+// Typedefs
+//------------------------------------------------------------------------------------
+typedef struct {
+	uint8_t addr;
+	uint8_t data;
+} write_t;
+
+// One command of the output stream, kept for the link simulation
+typedef struct {
+	uint32_t end;		// Offset just past the command in the stream
+	uint16_t wait;		// Samples the command waits
+	uint8_t writes;		// Register writes the command makes
+} command_t;
+
+//------------------------------------------------------------------------------------
+// Global Variables
+//------------------------------------------------------------------------------------
+static uint8_t *out;
+static uint32_t outLen, outCap;
+
+static command_t *cmds;
+static uint32_t cmdLen, cmdCap;
+
+// What the board's registers hold, as far as the stream has told it
+static uint8_t shadow[NUM_REGISTERS];
+static uint8_t known[NUM_REGISTERS];
+
+// Writes waiting to go out at time "now"
+static write_t batch[MAX_BATCH];
+static uint16_t batchLen;
+
+static uint32_t now;		// Sample time of the writes being collected
+static uint32_t emitted;	// Sample time the stream has been advanced to
+
+static uint32_t *perSecond;
+static uint32_t perSecondLen;
+
+static uint32_t writesIn, writesOut, naiveBytes;
+
+// Bytes in front of the stream that the MIDI FSM eats
+static uint32_t headerLen;
+
+//------------------------------------------------------------------------------------
+// Function Prototypes
+//------------------------------------------------------------------------------------
+void delay_us(uint16_t waitTime);
+
+static void emit(uint8_t b);
+static void endCommand(uint16_t wait, uint8_t writes);
+static void emitWait(uint32_t samples);
+static void flushBatch(void);
+static void setTime(uint32_t t);
+static int convertVgm(const uint8_t *buf, uint32_t len);
+static int convertMidi(const uint8_t *buf, uint32_t len);
+static void report(const char *name);
+
+//------------------------------------------------------------------------------------
+// delay_us
+//------------------------------------------------------------------------------------
+// The driver's bus timing means nothing here
+void delay_us(uint16_t waitTime)
+{
+	(void)waitTime;
+}
+
+//------------------------------------------------------------------------------------
+// traceWrite
+//------------------------------------------------------------------------------------
+// Queue a register write for time "now"
+static void traceWrite(uint8_t addr, uint8_t data)
+{
+	++writesIn;
+	if(batchLen == MAX_BATCH) flushBatch();
+	batch[batchLen].addr = addr;
+	batch[batchLen].data = data;
+	++batchLen;
+}
+
+//------------------------------------------------------------------------------------
+// emit
+//------------------------------------------------------------------------------------
+// Append a byte to the output stream
+static void emit(uint8_t b)
+{
+	uint32_t sec;
+	if(outLen == outCap)
+	{
+		outCap = outCap ? outCap * 2 : 4096;
+		out = realloc(out, outCap);
+		if(!out) { perror("realloc"); exit(1); }
+	}
+	out[outLen++] = b;
+
+	// Bytes per second of playing time
+	sec = emitted / SAMPLE_RATE;
+	if(sec >= perSecondLen)
+	{
+		uint32_t newLen = sec * 2 + 16;
+		perSecond = realloc(perSecond, newLen * sizeof(uint32_t));
+		if(!perSecond) { perror("realloc"); exit(1); }
+		memset(perSecond + perSecondLen, 0, (newLen - perSecondLen) * sizeof(uint32_t));
+		perSecondLen = newLen;
+	}
+	++perSecond[sec];
+}
+
+//------------------------------------------------------------------------------------
+// endCommand
+//------------------------------------------------------------------------------------
+// Mark the end of a command for the link simulation
+static void endCommand(uint16_t wait, uint8_t writes)
+{
+	if(cmdLen == cmdCap)
+	{
+		cmdCap = cmdCap ? cmdCap * 2 : 1024;
+		cmds = realloc(cmds, cmdCap * sizeof(command_t));
+		if(!cmds) { perror("realloc"); exit(1); }
+	}
+	cmds[cmdLen].end = outLen;
+	cmds[cmdLen].wait = wait;
+	cmds[cmdLen].writes = writes;
+	++cmdLen;
+}
+
+//------------------------------------------------------------------------------------
+// emitWait
+//------------------------------------------------------------------------------------
+// Advance the stream by "samples" using the shortest commands that fit
+static void emitWait(uint32_t samples)
+{
+	uint16_t chunk;
+	while(samples)
+	{
+		if(samples == 735)
+		{
+			chunk = 735;
+			emit(VGM_WAIT_60HZ);
+		}
+		else if(samples == 882)
+		{
+			chunk = 882;
+			emit(VGM_WAIT_50HZ);
+		}
+		else if(samples <= 16)
+		{
+			chunk = samples;
+			emit(VGM_WAIT_SHORT | (chunk - 1));
+		}
+		else if(samples <= 0x3FFF)
+		{
+			chunk = samples;
+			emit(STREAM_WAIT_VARINT);
+			if(chunk < 0x80)
+			{
+				emit(chunk);
+			}
+			else
+			{
+				emit(0x80 | (chunk & 0x7F));
+				emit(chunk >> 7);
+			}
+		}
+		else
+		{
+			chunk = (samples > 0xFFFF) ? 0xFFFF : samples;
+			emit(VGM_WAIT);
+			emit(chunk & 0xFF);
+			emit(chunk >> 8);
+		}
+		naiveBytes += (chunk <= 16 || chunk == 735 || chunk == 882) ? 1 : 3;
+		samples -= chunk;
+		emitted += chunk;
+		endCommand(chunk, 0);
+	}
+}
+
+//------------------------------------------------------------------------------------
+// setShadow
+//------------------------------------------------------------------------------------
+// Remember what a register now holds on the board
+static void setShadow(uint8_t addr, uint8_t data)
+{
+	if(addr >= NUM_REGISTERS) return;
+	shadow[addr] = data;
+	known[addr] = 1;
+}
+
+//------------------------------------------------------------------------------------
+// flushBatch
+//------------------------------------------------------------------------------------
+// Encode the writes collected for time "now"
+static void flushBatch(void)
+{
+	uint16_t i;
+	uint8_t addr, data, voice;
+
+	if(batchLen == 0) return;
+	emitWait(now - emitted);
+
+	for(i = 0; i < batchLen; ++i)
+	{
+		addr = batch[i].addr;
+		data = batch[i].data;
+		voice = addr & 0x0F;
+		naiveBytes += 3;
+
+		// No-op against what the board already has
+		if(addr < NUM_REGISTERS && known[addr] && shadow[addr] == data)
+			continue;
+
+		if((addr & 0xF0) == 0x10 && voice < MAX_VOICES &&
+		   i + 1 < batchLen && batch[i + 1].addr == 0x20 + voice)
+		{
+			// F-number and block/key go out together
+			emit(STREAM_NOTE | voice);
+			emit(data);
+			emit(batch[i + 1].data);
+			setShadow(addr, data);
+			setShadow(0x20 + voice, batch[i + 1].data);
+			naiveBytes += 3;
+			writesOut += 2;
+			endCommand(0, 2);
+			++i;
+			continue;
+		}
+
+		if((addr & 0xF0) == 0x20 && voice < MAX_VOICES && known[addr] &&
+		   (shadow[addr] ^ data) == 0x10)
+		{
+			// Only the key bit changed
+			emit(((data & 0x10) ? STREAM_KEY_ON : STREAM_KEY_OFF) | voice);
+		}
+		else if((addr & 0xF0) == 0x30 && voice < MAX_VOICES)
+		{
+			emit(STREAM_INSTRUMENT | voice);
+			emit(data);
+		}
+		else
+		{
+			emit(VGM_YM2413_WRITE);
+			emit(addr);
+			emit(data);
+		}
+		setShadow(addr, data);
+		++writesOut;
+		endCommand(0, 1);
+	}
+	batchLen = 0;
+}
+
+//------------------------------------------------------------------------------------
+// setTime
+//------------------------------------------------------------------------------------
+// Move the write clock forward, sending anything collected before that
+static void setTime(uint32_t t)
+{
+	if(t == now) return;
+	flushBatch();
+	now = t;
+}
+
+//------------------------------------------------------------------------------------
+// convertVgm
+//------------------------------------------------------------------------------------
+// Take the YM2413 writes out of a VGM log, skipping everything for other chips
+static int convertVgm(const uint8_t *buf, uint32_t len)
+{
+	uint32_t version;
+	uint32_t pos = 0x40;
+	uint32_t t = 0;
+	uint32_t size;
+	uint8_t cmd;
+
+	// Every version of the header is at least 0x40 bytes
+	if(len < 0x40)
+	{
+		fprintf(stderr, "VGM file is too short for its header\n");
+		return -1;
+	}
+	version = buf[0x08] | (buf[0x09] << 8) | (buf[0x0A] << 16) | ((uint32_t)buf[0x0B] << 24);
+	if(version >= 0x150)
+	{
+		uint32_t offset = buf[0x34] | (buf[0x35] << 8) | (buf[0x36] << 16) | ((uint32_t)buf[0x37] << 24);
+		if(offset) pos = 0x34 + offset;
+	}
+	if(!(buf[0x10] | buf[0x11] | buf[0x12] | buf[0x13]))
+		fprintf(stderr, "warning: VGM header has no YM2413 clock\n");
+
+	while(pos < len)
+	{
+		cmd = buf[pos];
+		if(cmd == VGM_END) break;
+
+		if(cmd == VGM_YM2413_WRITE)
+		{
+			if(pos + 2 >= len) break;
+			setTime(t);
+			traceWrite(buf[pos + 1], buf[pos + 2]);
+			pos += 3;
+		}
+		else if(cmd == VGM_WAIT)
+		{
+			if(pos + 2 >= len) break;
+			t += buf[pos + 1] | (buf[pos + 2] << 8);
+			pos += 3;
+		}
+		else if(cmd == VGM_WAIT_60HZ) { t += 735; pos += 1; }
+		else if(cmd == VGM_WAIT_50HZ) { t += 882; pos += 1; }
+		else if((cmd & 0xF0) == 0x70) { t += (cmd & 0x0F) + 1; pos += 1; }
+		else if((cmd & 0xF0) == 0x80) { t += cmd & 0x0F; pos += 1; }
+		else if(cmd == 0x67)
+		{
+			// Data block: 0x67 0x66 type size32 data
+			if(pos + 6 >= len) break;
+			size = buf[pos + 3] | (buf[pos + 4] << 8) | (buf[pos + 5] << 16) | ((uint32_t)buf[pos + 6] << 24);
+			// A corrupt size could wrap pos back into the file
+			if(size > len - pos - 7)
+			{
+				fprintf(stderr, "VGM data block at 0x%X runs past the end of the file\n", pos);
+				return -1;
+			}
+			pos += 7 + size;
+		}
+		else if(cmd == 0x68) pos += 12;
+		else if(cmd == 0x90 || cmd == 0x91 || cmd == 0x95) pos += 5;
+		else if(cmd == 0x92) pos += 6;
+		else if(cmd == 0x93) pos += 11;
+		else if(cmd == 0x94) pos += 2;
+		else if(cmd >= 0x30 && cmd <= 0x3F) pos += 2;
+		else if(cmd == 0x4F || cmd == 0x50) pos += 2;
+		else if(cmd >= 0x40 && cmd <= 0x5F) pos += 3;
+		else if(cmd >= 0xA0 && cmd <= 0xBF) pos += 3;
+		else if(cmd >= 0xC0 && cmd <= 0xDF) pos += 4;
+		else if(cmd >= 0xE0) pos += 5;
+		else
+		{
+			fprintf(stderr, "unknown VGM command 0x%02X at 0x%X\n", cmd, pos);
+			return -1;
+		}
+	}
+
+	setTime(t);
+	flushBatch();
+	return 0;
+}
+
+//------------------------------------------------------------------------------------
+// convertMidi
+//------------------------------------------------------------------------------------
+// Play a standard MIDI file through the driver and record what it writes
+static int convertMidi(const uint8_t *buf, uint32_t len)
+{
+	smf_event_t *events;
+	int32_t numEvents, n;
+	uint32_t played = 0, sample, nextTick = TICK_SAMPLES;
+
+	numEvents = smfRead(buf, len, &events);
+	if(numEvents < 0) return -1;
+
+	// Start from the same state the board is left in by resetSynth()
+	resetSynth();
+	modReset();
+
+	for(n = 0; n < numEvents; ++n)
+	{
+		smf_event_t *e = &events[n];
+
+		// Note on / note off and control change, the only messages the MIDI FSM plays
+		if((e->status & 0xE0) != 0x80 && (e->status & 0xF0) != 0xB0) continue;
+		sample = (uint32_t)llround(e->us * SAMPLE_RATE / 1e6);
+
+		// Modulation runs on its own tick in between
+		for(; nextTick <= sample; nextTick += TICK_SAMPLES)
+		{
+			setTime(nextTick);
+			modService(MOD_WRITES_IDLE);
+		}
+		setTime(sample);
+
+		// Same handling as two_bytes() in the firmware
+		if((e->status & 0xF0) == 0xB0)
+			modControl(e->status & 0x0F, e->data1, e->data2);
+		else if((e->status & 0xF0) == 0x90 && e->data2 != 0)
+			modNoteOn(e->data1, e->status & 0x0F, (uint8_t)~e->data2);
+		else
+			modNoteOff(e->data1, e->status & 0x0F);
+		++played;
+	}
+
+	killAll();
+	flushBatch();
+	fprintf(stderr, "notes:       %u events, %u dropped (no free voice), %u orphaned note-offs\n",
+		played, stats.notesDropped, stats.orphanNoteOffs);
+	free(events);
+	return 0;
+}
+
+//------------------------------------------------------------------------------------
+// simulateLink
+//------------------------------------------------------------------------------------
+// Step the serial link, the XON/XOFF flow control and the board's playback one
+// sample at a time. Returns how many times the board would have run dry.
+static uint32_t simulateLink(uint32_t *maxFill)
+{
+	uint32_t sent = headerLen, consumed = headerLen;
+	uint32_t credit = 0, ci = 0, underruns = 0;
+	uint64_t t = 0, due = 0;
+	double busy = 0;
+	uint8_t paused = 0, starved = 1;
+
+	*maxFill = 0;
+	while(ci < cmdLen)
+	{
+		// Link
+		if(!paused)
+		{
+			credit += LINK_RATE;
+			while(credit >= SAMPLE_RATE && sent < outLen)
+			{
+				++sent;
+				credit -= SAMPLE_RATE;
+			}
+			if(sent - consumed >= STREAM_XOFF_LEVEL) paused = 1;
+		}
+		if(sent - consumed > *maxFill) *maxFill = sent - consumed;
+
+		// Board, mirroring streamService()
+		while(ci < cmdLen && t >= due && busy <= t)
+		{
+			if(starved)
+			{
+				if(sent == consumed) due = t;
+				if(sent == consumed ||
+				   (sent - consumed < STREAM_PREFILL && t - due < STREAM_PREFILL_WAIT))
+					break;
+				due = t;
+				starved = 0;
+			}
+			if(sent < cmds[ci].end)
+			{
+				++underruns;
+				starved = 1;
+				due = t;
+				break;
+			}
+			consumed = cmds[ci].end;
+			due += cmds[ci].wait;
+			busy = t + cmds[ci].writes * (WRITE_TIME_US * SAMPLE_RATE / 1e6);
+			++ci;
+			if(paused && sent - consumed <= STREAM_XON_LEVEL) paused = 0;
+		}
+		++t;
+	}
+	return underruns;
+}
+
+//------------------------------------------------------------------------------------
+// report
+//------------------------------------------------------------------------------------
+// Tell the user whether the stream fits through the link
+static void report(const char *name)
+{
+	uint32_t sec, peak = 0, peakSec = 0, maxFill, underruns;
+	double seconds = (double)emitted / SAMPLE_RATE;
+
+	for(sec = 0; sec < perSecondLen; ++sec)
+	{
+		if(perSecond[sec] > peak)
+		{
+			peak = perSecond[sec];
+			peakSec = sec;
+		}
+	}
+	underruns = simulateLink(&maxFill);
+
+	fprintf(stderr, "input:       %s, %u:%04.1f long\n", name, (unsigned)(seconds / 60), fmod(seconds, 60));
+	fprintf(stderr, "writes:      %u in, %u out, %u elided\n", writesIn, writesOut, writesIn - writesOut);
+	fprintf(stderr, "size:        %u bytes (%u as plain VGM commands, %.0f%% saved)\n",
+		outLen, naiveBytes, naiveBytes ? 100.0 * (1.0 - (double)outLen / naiveBytes) : 0.0);
+	fprintf(stderr, "rate:        %.0f B/s average, %u B/s peak at %u:%02u, link is %u B/s\n",
+		seconds > 0 ? outLen / seconds : 0.0, peak, peakSec / 60, peakSec % 60, LINK_RATE);
+	fprintf(stderr, "buffer:      %u of %u bytes used at most\n", maxFill, STREAM_BUFFER_SIZE);
+	if(underruns)
+		fprintf(stderr, "result:      DOES NOT FIT, board runs dry %u times\n", underruns);
+	else
+		fprintf(stderr, "result:      fits the link budget\n");
+}
+
+//------------------------------------------------------------------------------------
+// main
+//------------------------------------------------------------------------------------
+int main(int argc, char **argv)
+{
+	const char *inName = NULL, *outName = NULL;
+	uint8_t raw = 0, *buf;
+	uint32_t len;
+	long size;
+	int i, result;
+	FILE *f;
+
+	for(i = 1; i < argc; ++i)
+	{
+		if(!strcmp(argv[i], "-r")) raw = 1;
+		else if(!strcmp(argv[i], "-o") && i + 1 < argc) outName = argv[++i];
+		else if(argv[i][0] != '-' && !inName) inName = argv[i];
+		else
+		{
+			fprintf(stderr, "usage: %s [-r] [-o output] input.vgm|input.mid\n", argv[0]);
+			return 2;
+		}
+	}
+	if(!inName)
+	{
+		fprintf(stderr, "usage: %s [-r] [-o output] input.vgm|input.mid\n", argv[0]);
+		return 2;
+	}
+
+	f = fopen(inName, "rb");
+	if(!f) { perror(inName); return 1; }
+	fseek(f, 0, SEEK_END);
+	size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	buf = malloc(size > 0 ? size : 1);
+	if(!buf || fread(buf, 1, size, f) != (size_t)size) { perror(inName); return 1; }
+	fclose(f);
+	len = size;
+
+	if(!raw)
+	{
+		// Puts the board in register stream mode, not part of the stream itself
+		emit(0xF0); emit(0x7D); emit(0x10); emit(0xF7);
+		headerLen = outLen;
+		perSecond[0] -= headerLen;
+	}
+
+	if(len >= 4 && !memcmp(buf, "Vgm ", 4))
+	{
+		result = convertVgm(buf, len);
+	}
+	else if(len >= 4 && !memcmp(buf, "MThd", 4))
+	{
+		result = convertMidi(buf, len);
+	}
+	else
+	{
+		fprintf(stderr, "%s: not a VGM or MIDI file (gunzip .vgz files first)\n", inName);
+		return 1;
+	}
+	if(result) return 1;
+
+	emit(VGM_END);
+	endCommand(0, 0);
+	report(inName);
+
+	f = outName ? fopen(outName, "wb") : stdout;
+	if(!f || fwrite(out, 1, outLen, f) != outLen) { perror(outName ? outName : "stdout"); return 1; }
+	if(outName) fclose(f);
+	free(buf);
+	return 0;
+}